@@ -3,29 +3,38 @@
 #include "console.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "event.h"
 #include "report.h"
 
 /* Some global values */
 int simulation = 0;
 static cmd_ptr cmd_list = NULL;
 static param_ptr param_list = NULL;
-static bool block_flag = false;
-static bool prompt_flag = true;
 
-/* Am I timing a command that has the console blocked? */
-static bool block_timing = false;
+/* Hash tables for looking up commands and parameters by name */
+#define HASH_SIZE 64 /* Must be power of 2 */
+static cmd_ptr cmd_hash[HASH_SIZE];
+static param_ptr param_hash[HASH_SIZE];
+static bool prompt_flag = true;
 
 /* Time of day */
 static double first_time;
@@ -34,34 +43,40 @@ static double last_time;
 /*
  * Implement buffered I/O using variant of RIO package from CS:APP
  * Must create stack of buffers to handle I/O with nested source commands.
+ * Regular files are mapped into memory as a whole and used as the buffer,
+ * other input is read in large blocks.
  */
 
-#define RIO_BUFSIZE 8192
+#define RIO_BUFSIZE 8192    /* Maximum length of command line */
+#define RIO_BLOCKSIZE 65536 /* Size of read buffer */
 typedef struct RIO_ELE rio_t, *rio_ptr;
 
 struct RIO_ELE {
-    int fd;                /* File descriptor */
-    int cnt;               /* Unread bytes in internal buffer */
-    char *bufptr;          /* Next unread byte in internal buffer */
-    char buf[RIO_BUFSIZE]; /* Internal buffer */
-    rio_ptr prev;          /* Next element in stack */
+    int fd;                  /* File descriptor */
+    ssize_t cnt;             /* Unread bytes in internal buffer */
+    char *bufptr;            /* Next unread byte in internal buffer */
+    char *map;               /* Mapped file contents, or NULL */
+    size_t map_len;          /* Length of mapping */
+    char buf[RIO_BLOCKSIZE]; /* Internal buffer */
+    rio_ptr prev;            /* Next element in stack */
 };
 
 static rio_ptr buf_stack;
 static char linebuf[RIO_BUFSIZE];
 
-/* Maximum file descriptor */
-static int fd_max = 0;
-
 /* Parameters */
 static int err_limit = 5;
 static int err_cnt = 0;
 static int echo = 0;
 
 static bool quit_flag = false;
+static bool quit_done = false; /* Quit helpers have been run */
 static char *prompt = "cmd> ";
 static bool has_infile = false;
 
+/* Running as server, with commands shared by sessions */
+static bool serving = false;
+
 /* Optional function to call as part of exit process */
 /* Maximum number of quit functions */
 
@@ -69,12 +84,52 @@ static bool has_infile = false;
 static cmd_function quit_helpers[MAXQUIT];
 static int quit_helper_cnt = 0;
 
+/* Optional function to call around timed commands */
+static time_helper_function time_helper = NULL;
+
 static void init_in();
 
 static bool push_file(char *fname);
 static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
+static bool dispatch_cmd(int argc, char *argv[], cmd_ptr c);
+static void clear_blocks();
+
+/* FNV-1a hash of string */
+static uint32_t hash_str(const char *str)
+{
+    uint32_t h = 2166136261U;
+    while (*str) {
+        h ^= (unsigned char) *str++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/* Hash of name, reduced to bucket index */
+static unsigned int hash_name(const char *name)
+{
+    return hash_str(name) & (HASH_SIZE - 1);
+}
+
+/* Find command by name.  Return NULL if not found */
+static cmd_ptr find_cmd(const char *name)
+{
+    cmd_ptr c = cmd_hash[hash_name(name)];
+    while (c && strcmp(name, c->name))
+        c = c->hash_next;
+    return c;
+}
+
+/* Find parameter by name.  Return NULL if not found */
+static param_ptr find_param(const char *name)
+{
+    param_ptr p = param_hash[hash_name(name)];
+    while (p && strcmp(name, p->name))
+        p = p->hash_next;
+    return p;
+}
 
 /* Add a new command */
 void add_cmd(char *name, cmd_function operation, char *documentation)
@@ -90,8 +145,14 @@ void add_cmd(char *name, cmd_function operation, char *documentation)
     ele->name = name;
     ele->operation = operation;
     ele->documentation = documentation;
+    ele->runs = ele->errors = 0;
+    memset(ele->latency, 0, sizeof(ele->latency));
     ele->next = next_cmd;
     *last_loc = ele;
+
+    unsigned int h = hash_name(name);
+    ele->hash_next = cmd_hash[h];
+    cmd_hash[h] = ele;
 }
 
 /* Add a new parameter */
@@ -114,50 +175,44 @@ void add_param(char *name,
     ele->setter = setter;
     ele->next = next_param;
     *last_loc = ele;
+
+    unsigned int h = hash_name(name);
+    ele->hash_next = param_hash[h];
+    param_hash[h] = ele;
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
+/* Maximum number of arguments in a command line */
+#define MAXARGS 64
+static char *argv_buf[MAXARGS];
+
+/*
+ * Parse a string into a command line, storing the arguments in argv,
+ * which has room for MAXARGS of them.
+ * The line is split in place by replacing white space with null characters.
+ * Return argv, or NULL if the line has too many arguments.
+ */
+static char **parse_args(char *line, char *argv[], int *argcp)
 {
-    /*
-     * Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
-    char *src = line;
-    char *dst = buf;
-    bool skipping = true;
-    int c;
+    char *p = line;
     int argc = 0;
-    while ((c = *src++) != '\0') {
-        if (isspace(c)) {
-            if (!skipping) {
-                /* Hit end of word */
-                *dst++ = '\0';
-                skipping = true;
-            }
-        } else {
-            if (skipping) {
-                /* Hit start of new word */
-                argc++;
-                skipping = false;
-            }
-            *dst++ = c;
+    while (true) {
+        while (isspace((unsigned char) *p))
+            p++;
+        if (*p == '\0')
+            break;
+        if (argc == MAXARGS) {
+            report(1, "Too many arguments (limit is %d)", MAXARGS);
+            return NULL;
         }
+        /* Hit start of new word */
+        argv[argc++] = p;
+        while (*p && !isspace((unsigned char) *p))
+            p++;
+        /* Hit end of word */
+        if (*p)
+            *p++ = '\0';
     }
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
-    }
-
-    free_block(buf, len + 1);
     *argcp = argc;
     return argv;
 }
@@ -171,18 +226,76 @@ static void record_error()
     }
 }
 
+/* Account for a run of command c from start to stop */
+static void count_run(cmd_ptr c,
+                      const struct timespec *start,
+                      const struct timespec *stop,
+                      bool ok)
+{
+    uint64_t us = (stop->tv_sec - start->tv_sec) * 1000000ULL +
+                  (stop->tv_nsec - start->tv_nsec) / 1000;
+    int bucket = 0;
+    while (us && bucket < LATENCY_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    c->runs++;
+    c->latency[bucket]++;
+    if (!ok)
+        c->errors++;
+}
+
+/* Run command c, timing it and counting the run in its statistics */
+static bool run_cmd(cmd_ptr c, int argc, char *argv[])
+{
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool ok = c->operation(argc, argv);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    /* "quit" may have freed the command table, c included */
+    if (!quit_done)
+        count_run(c, &start, &stop, ok);
+    return ok;
+}
+
+void cmd_stats_json(FILE *out)
+{
+    bool first = true;
+    fprintf(out, "\"commands\":{");
+    for (cmd_ptr c = cmd_list; c; c = c->next) {
+        if (!c->runs)
+            continue;
+        fprintf(out,
+                "%s\"%s\":{\"runs\":%zu,\"errors\":%zu,\"latency_us\":{",
+                first ? "" : ",", c->name, c->runs, c->errors);
+        first = false;
+        /* Buckets keyed by their upper bound, only those counted */
+        bool none = true;
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            if (!c->latency[i])
+                continue;
+            if (i < LATENCY_BUCKETS - 1)
+                fprintf(out, "%s\"%" PRIu64 "\":%zu", none ? "" : ",",
+                        (uint64_t) 1 << i, c->latency[i]);
+            else
+                fprintf(out, "%s\"inf\":%zu", none ? "" : ",", c->latency[i]);
+            none = false;
+        }
+        fprintf(out, "}}");
+    }
+    fprintf(out, "}");
+}
+
 /* Execute a command that has already been split into arguments */
 static bool interpret_cmda(int argc, char *argv[])
 {
     if (argc == 0)
         return true;
     /* Try to find matching command */
-    cmd_ptr next_cmd = cmd_list;
+    cmd_ptr next_cmd = find_cmd(argv[0]);
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
-        ok = next_cmd->operation(argc, argv);
+        ok = run_cmd(next_cmd, argc, argv);
         if (!ok)
             record_error();
     } else {
@@ -194,7 +307,10 @@ static bool interpret_cmda(int argc, char *argv[])
     return ok;
 }
 
-/* Execute a command from a command line */
+/*
+ * Execute a command from a command line.
+ * Note that cmdline is modified by splitting it into arguments.
+ */
 static bool interpret_cmd(char *cmdline)
 {
     if (quit_flag)
@@ -204,13 +320,13 @@ static bool interpret_cmd(char *cmdline)
     report(6, "Interpreting command '%s'\n", cmdline);
 #endif
     int argc;
-    char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
+    char **argv = parse_args(cmdline, argv_buf, &argc);
+    if (!argv) {
+        record_error();
+        return false;
+    }
 
-    return ok;
+    return dispatch_cmd(argc, argv, NULL);
 }
 
 /* Set function to be executed as part of program exit */
@@ -222,6 +338,12 @@ void add_quit_helper(cmd_function qf)
         report_event(MSG_FATAL, "Exceeded limit on quit helpers");
 }
 
+/* Set function to be invoked around commands run by "time" */
+void set_time_helper(time_helper_function tf)
+{
+    time_helper = tf;
+}
+
 /* Turn echoing on/off */
 void set_echo(bool on)
 {
@@ -231,19 +353,29 @@ void set_echo(bool on)
 /* Built-in commands */
 static bool do_quit(int argc, char *argv[])
 {
-    cmd_ptr c = cmd_list;
+    /* Statements of unfinished blocks refer to commands */
+    clear_blocks();
+
     bool ok = true;
-    while (c) {
-        cmd_ptr ele = c;
-        c = c->next;
-        free_block(ele, sizeof(cmd_ele));
-    }
+    if (!serving) {
+        cmd_ptr c = cmd_list;
+        while (c) {
+            cmd_ptr ele = c;
+            c = c->next;
+            free_block(ele, sizeof(cmd_ele));
+        }
+
+        param_ptr p = param_list;
+        while (p) {
+            param_ptr ele = p;
+            p = p->next;
+            free_block(ele, sizeof(param_ele));
+        }
 
-    param_ptr p = param_list;
-    while (p) {
-        param_ptr ele = p;
-        p = p->next;
-        free_block(ele, sizeof(param_ele));
+        cmd_list = NULL;
+        param_list = NULL;
+        memset(cmd_hash, 0, sizeof(cmd_hash));
+        memset(param_hash, 0, sizeof(param_hash));
     }
 
     while (buf_stack)
@@ -254,6 +386,7 @@ static bool do_quit(int argc, char *argv[])
     }
 
     quit_flag = true;
+    quit_done = true;
     return ok;
 }
 
@@ -317,7 +450,6 @@ static bool do_option(int argc, char *argv[])
     for (int i = 1; i < argc; i++) {
         char *name = argv[i];
         int value = 0;
-        bool found = false;
         /* Get value from next argument */
         if (i + 1 >= argc) {
             report(1, "No value given for parameter %s", name);
@@ -326,23 +458,17 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_ptr plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
-        }
+        /* Find parameter in table */
+        param_ptr param = find_param(name);
         /* Didn't find parameter */
-        if (!found) {
+        if (!param) {
             report(1, "Unknown parameter '%s'", name);
             return false;
         }
+        int oldval = *param->valp;
+        *param->valp = value;
+        if (param->setter)
+            param->setter(oldval);
     }
 
     return true;
@@ -385,23 +511,632 @@ static bool do_time(int argc, char *argv[])
         double elapsed = last_time - first_time;
         report(1, "Elapsed time = %.3f, Delta time = %.3f", elapsed, delta);
     } else {
+        if (time_helper)
+            time_helper(false);
         ok = interpret_cmda(argc - 1, argv + 1);
-        if (block_flag) {
-            block_timing = true;
-        } else {
-            delta = delta_time(&last_time);
-            report(1, "Delta time = %.3f", delta);
+        delta = delta_time(&last_time);
+        report(1, "Delta time = %.3f", delta);
+        if (time_helper)
+            time_helper(true);
+    }
+
+    return ok;
+}
+
+/*
+ * Repeat blocks and variables.
+ * Each line in the body of a repeat block is split into arguments and its
+ * command looked up once, as the line is read.  The saved statements are
+ * then run as many times as requested.  An argument of the form $name is
+ * replaced by the current value of the variable.  Variables are created
+ * by "set" and by repeat blocks counting in them, and referring to any
+ * other is an error.
+ */
+typedef struct VAR_ELE var_ele, *var_ptr;
+struct VAR_ELE {
+    char *name;
+    int value;
+    var_ptr next;
+};
+
+static var_ptr var_list = NULL;
+
+typedef struct STMT_ELE stmt_ele, *stmt_ptr;
+struct STMT_ELE {
+    cmd_ptr cmd;     /* Command, or NULL for repeat */
+    int argc;        /* Number of arguments */
+    char **argv;     /* Saved copies of arguments */
+    var_ptr *vars;   /* Variable named by each argument, or NULL */
+    int reps;        /* Repeat count */
+    var_ptr counter; /* Loop counter, or NULL */
+    stmt_ptr body;   /* Repeated statements */
+    stmt_ptr next;
+};
+
+/* Repeat blocks whose body is still being read */
+#define MAXNEST 16
+typedef struct {
+    stmt_ptr loop;
+    stmt_ptr *tail; /* Where to add next statement of body */
+} nest_frame_t;
+static nest_frame_t nest_stack[MAXNEST];
+static int nest_depth = 0;
+
+/* Values of variables substituted into command line */
+static char var_text[MAXARGS][12];
+
+/* Find variable by name.  Return NULL if there is none */
+static var_ptr find_var(char *name)
+{
+    var_ptr v = var_list;
+    while (v && strcmp(name, v->name))
+        v = v->next;
+    return v;
+}
+
+/* Find variable by name, creating it with value 0 if there is none */
+static var_ptr make_var(char *name)
+{
+    var_ptr v = find_var(name);
+    if (!v) {
+        v = malloc_or_fail(sizeof(var_ele), "make_var");
+        v->name = strsave_or_fail(name, "make_var");
+        v->value = 0;
+        v->next = var_list;
+        var_list = v;
+    }
+    return v;
+}
+
+/* Find variable referred to by argument, complaining if there is none */
+static var_ptr ref_var(char *arg)
+{
+    var_ptr v = find_var(arg + 1);
+    if (!v)
+        report(1, "Unknown variable '%s'", arg + 1);
+    return v;
+}
+
+/* Does argument refer to a variable? */
+static bool is_var_ref(const char *arg)
+{
+    return arg[0] == '$' && arg[1] != '\0';
+}
+
+static void free_stmts(stmt_ptr s)
+{
+    while (s) {
+        stmt_ptr next = s->next;
+        if (s->cmd) {
+            for (int i = 0; i < s->argc; i++)
+                free_string(s->argv[i]);
+            free_array(s->argv, s->argc, sizeof(char *));
+            if (s->vars)
+                free_array(s->vars, s->argc, sizeof(var_ptr));
+        }
+        free_stmts(s->body);
+        free_block(s, sizeof(stmt_ele));
+        s = next;
+    }
+}
+
+/* Discard unfinished blocks and all variables */
+static void clear_blocks()
+{
+    if (nest_depth > 0) {
+        report(1, "ERROR: Unterminated repeat block");
+        err_cnt++;
+        free_stmts(nest_stack[0].loop);
+        nest_depth = 0;
+    }
+
+    while (var_list) {
+        var_ptr v = var_list;
+        var_list = v->next;
+        free_string(v->name);
+        free_block(v, sizeof(var_ele));
+    }
+}
+
+/*
+ * Make statement from command line split into arguments.
+ * Forms of repeat are "repeat N cmd arg ..." and "repeat N [var] {",
+ * where the latter sets *openp, and the body follows up to a line "}".
+ * Return NULL if the line is not valid.
+ */
+static stmt_ptr make_stmt(int argc, char *argv[], bool *openp)
+{
+    *openp = false;
+    if (strcmp(argv[0], "repeat")) {
+        cmd_ptr c = find_cmd(argv[0]);
+        if (!c) {
+            report(1, "Unknown command '%s'", argv[0]);
+            return NULL;
+        }
+        stmt_ptr s = calloc_or_fail(1, sizeof(stmt_ele), "make_stmt");
+        s->cmd = c;
+        s->argc = argc;
+        s->argv = calloc_or_fail(argc, sizeof(char *), "make_stmt");
+        /* A variable set in the block itself is found when first run */
+        if (c->operation != do_comment_cmd)
+            s->vars = calloc_or_fail(argc, sizeof(var_ptr), "make_stmt");
+        for (int i = 0; i < argc; i++) {
+            s->argv[i] = strsave_or_fail(argv[i], "make_stmt");
+            if (s->vars && is_var_ref(argv[i]))
+                s->vars[i] = find_var(argv[i] + 1);
+        }
+        return s;
+    }
+
+    int reps;
+    bool open = (argc == 3 || argc == 4) && !strcmp(argv[argc - 1], "{");
+    if (argc < 3 || !get_int(argv[1], &reps) || reps < 0) {
+        report(1, "Usage: repeat N cmd arg ... | repeat N [var] {");
+        return NULL;
+    }
+
+    stmt_ptr body = NULL;
+    if (!open) {
+        bool body_open;
+        body = make_stmt(argc - 2, argv + 2, &body_open);
+        if (body && body_open) {
+            report(1, "Block must be opened by outer repeat");
+            free_stmts(body);
+            body = NULL;
+        }
+        if (!body)
+            return NULL;
+    }
+
+    stmt_ptr s = calloc_or_fail(1, sizeof(stmt_ele), "make_stmt");
+    s->reps = reps;
+    s->counter = open && argc == 4 ? make_var(argv[2]) : NULL;
+    s->body = body;
+    *openp = open;
+    return s;
+}
+
+/* Start reading body of repeat block */
+static bool open_block(stmt_ptr loop)
+{
+    if (nest_depth == MAXNEST) {
+        report(1, "Repeat blocks nested too deeply (limit is %d)", MAXNEST);
+        return false;
+    }
+    nest_stack[nest_depth].loop = loop;
+    nest_stack[nest_depth].tail = &loop->body;
+    nest_depth++;
+    return true;
+}
+
+static bool run_stmts(stmt_ptr s);
+
+static bool run_loop(stmt_ptr loop)
+{
+    bool ok = true;
+    for (int i = 0; i < loop->reps && !quit_flag; i++) {
+        if (loop->counter)
+            loop->counter->value = i;
+        ok = run_stmts(loop->body) && ok;
+    }
+    return ok;
+}
+
+static bool run_stmts(stmt_ptr s)
+{
+    bool ok = true;
+    for (; s && !quit_flag; s = s->next) {
+        if (!s->cmd) {
+            ok = run_loop(s) && ok;
+            continue;
+        }
+
+        /* Local storage, since commands may run nested blocks */
+        char *argv[MAXARGS];
+        char text[MAXARGS][12];
+        bool known = true;
+        for (int i = 0; i < s->argc && known; i++) {
+            argv[i] = s->argv[i];
+            if (!s->vars || !is_var_ref(argv[i]))
+                continue;
+            if (!s->vars[i])
+                s->vars[i] = ref_var(argv[i]);
+            known = s->vars[i] != NULL;
+            if (known) {
+                snprintf(text[i], sizeof(text[i]), "%d", s->vars[i]->value);
+                argv[i] = text[i];
+            }
+        }
+        if (!known || !run_cmd(s->cmd, s->argc, argv)) {
+            record_error();
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/*
+ * Add line to body of innermost open block, running the outermost
+ * block once its closing line has been read.
+ * Errors are recorded here.
+ */
+static bool record_stmt(int argc, char *argv[])
+{
+    if (!strcmp(argv[0], "}")) {
+        stmt_ptr loop = nest_stack[--nest_depth].loop;
+        if (nest_depth > 0)
+            return true;
+        bool ok = run_loop(loop);
+        free_stmts(loop);
+        return ok;
+    }
+
+    bool open;
+    stmt_ptr s = make_stmt(argc, argv, &open);
+    if (!s) {
+        record_error();
+        return false;
+    }
+    *nest_stack[nest_depth - 1].tail = s;
+    nest_stack[nest_depth - 1].tail = &s->next;
+    if (open && !open_block(s)) {
+        record_error();
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Run command line split into arguments, using command c if already known.
+ * Lines inside a repeat block are saved rather than run.
+ */
+static bool dispatch_cmd(int argc, char *argv[], cmd_ptr c)
+{
+    if (argc == 0)
+        return true;
+    if (nest_depth > 0)
+        return record_stmt(argc, argv);
+
+    if (strcmp(argv[0], "#")) {
+        for (int i = 1; i < argc; i++) {
+            if (!is_var_ref(argv[i]))
+                continue;
+            var_ptr v = ref_var(argv[i]);
+            if (!v) {
+                record_error();
+                return false;
+            }
+            snprintf(var_text[i], sizeof(var_text[i]), "%d", v->value);
+            argv[i] = var_text[i];
         }
     }
 
+    if (!c)
+        return interpret_cmda(argc, argv);
+    bool ok = run_cmd(c, argc, argv);
+    if (!ok)
+        record_error();
     return ok;
 }
 
+static bool do_repeat(int argc, char *argv[])
+{
+    bool open;
+    stmt_ptr loop = make_stmt(argc, argv, &open);
+    if (!loop)
+        return false;
+    if (open) {
+        if (!open_block(loop)) {
+            free_stmts(loop);
+            return false;
+        }
+        return true;
+    }
+
+    /* Errors in the body have already been recorded */
+    run_loop(loop);
+    free_stmts(loop);
+    return true;
+}
+
+static bool do_close_block(int argc, char *argv[])
+{
+    report(1, "No repeat block to close");
+    return false;
+}
+
+static bool do_set(int argc, char *argv[])
+{
+    if (argc == 1) {
+        for (var_ptr v = var_list; v; v = v->next)
+            report(1, "\t%s\t%d", v->name, v->value);
+        return true;
+    }
+
+    int value;
+    if (argc != 3 || !get_int(argv[2], &value)) {
+        report(1, "%s needs 2 arguments: variable name and integer value",
+               argv[0]);
+        return false;
+    }
+    make_var(argv[1])->value = value;
+    return true;
+}
+
+static bool do_inc(int argc, char *argv[])
+{
+    int delta = 1;
+    if (argc < 2 || argc > 3 || (argc == 3 && !get_int(argv[2], &delta))) {
+        report(1, "%s needs variable name and optional integer increment",
+               argv[0]);
+        return false;
+    }
+    var_ptr v = find_var(argv[1]);
+    if (!v) {
+        report(1, "Unknown variable '%s'", argv[1]);
+        return false;
+    }
+    v->value += delta;
+    return true;
+}
+
+/*
+ * Compiled command files.
+ * A trace is converted into a table of the command names it uses, a table
+ * of distinct argument strings and a sequence of records, each made of
+ * 32-bit words: index into command name table, number of arguments, then
+ * string table offset of each argument.  Replaying such file needs neither
+ * tokenizing nor command lookup.  A blank line is a record with index
+ * CFILE_BLANK and no arguments.
+ */
+#define CFILE_MAGIC "QCMD"
+#define CFILE_BLANK 0xffffffffU
+typedef struct {
+    char magic[4];        /* CFILE_MAGIC */
+    uint32_t nnames;      /* Entries in command name table */
+    uint32_t nrecords;    /* Number of commands */
+    uint32_t strtab_size; /* Bytes in string table, multiple of 4 */
+    uint32_t code_size;   /* Words in record sequence */
+} cfile_header;
+/* Followed by name table, string table, and records */
+
+/* Growable buffer used while compiling */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} cbuf_t;
+
+static void cbuf_append(cbuf_t *b, const void *src, size_t n)
+{
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 256;
+        while (cap < b->len + n)
+            cap *= 2;
+        char *data = malloc_or_fail(cap, "cbuf_append");
+        if (b->data) {
+            memcpy(data, b->data, b->len);
+            free_block(b->data, b->cap);
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, src, n);
+    b->len += n;
+}
+
+static void cbuf_append_word(cbuf_t *b, uint32_t w)
+{
+    cbuf_append(b, &w, sizeof(w));
+}
+
+/* Table of distinct strings, hashed by contents, storing offsets + 1 */
+typedef struct {
+    cbuf_t strtab;
+    uint32_t *slots;
+    size_t nslots;
+    size_t cnt;
+} strpool_t;
+
+/* Return offset of str in string table, adding it if not yet present */
+static uint32_t strpool_intern(strpool_t *sp, const char *str)
+{
+    if (2 * (sp->cnt + 1) > sp->nslots) {
+        /* Keep load factor below one half */
+        size_t nslots = sp->nslots ? 2 * sp->nslots : 256;
+        uint32_t *slots =
+            calloc_or_fail(nslots, sizeof(uint32_t), "strpool_intern");
+        for (size_t i = 0; i < sp->nslots; i++) {
+            if (!sp->slots[i])
+                continue;
+            size_t j = hash_str(sp->strtab.data + sp->slots[i] - 1);
+            while (slots[j & (nslots - 1)])
+                j++;
+            slots[j & (nslots - 1)] = sp->slots[i];
+        }
+        if (sp->slots)
+            free_array(sp->slots, sp->nslots, sizeof(uint32_t));
+        sp->slots = slots;
+        sp->nslots = nslots;
+    }
+
+    size_t j = hash_str(str);
+    while (sp->slots[j & (sp->nslots - 1)]) {
+        uint32_t off = sp->slots[j & (sp->nslots - 1)] - 1;
+        if (!strcmp(sp->strtab.data + off, str))
+            return off;
+        j++;
+    }
+    uint32_t off = sp->strtab.len;
+    cbuf_append(&sp->strtab, str, strlen(str) + 1);
+    sp->slots[j & (sp->nslots - 1)] = off + 1;
+    sp->cnt++;
+    return off;
+}
+
+/* Map whole file for reading.  Return NULL if cannot */
+static char *map_file(char *fname, size_t *lenp, int prot)
+{
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    char *map = NULL;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, prot, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+            map = NULL;
+        *lenp = st.st_size;
+    }
+    close(fd);
+    return map;
+}
+
+/* Convert command file infile into compiled command file outfile */
+static bool compile_file(char *infile, char *outfile)
+{
+    size_t len;
+    char *text = map_file(infile, &len, PROT_READ);
+    if (!text) {
+        report(1, "Could not read command file '%s'", infile);
+        return false;
+    }
+
+    /*
+     * Own line and arguments, as infile and outfile may point into those
+     * of the console when "compile" is itself read from a file
+     */
+    char line[RIO_BUFSIZE];
+    char *argv[MAXARGS];
+    cmd_ptr names[MAXARGS];
+    uint32_t nnames = 0, nrecords = 0;
+    strpool_t pool = {0};
+    cbuf_t code = {0};
+    bool ok = true;
+    int lineno = 0;
+    for (size_t pos = 0; ok && pos < len; lineno++) {
+        char *eol = memchr(text + pos, '\n', len - pos);
+        size_t n = (eol ? (size_t) (eol - text) : len) - pos;
+        if (n >= RIO_BUFSIZE) {
+            report(1, "Line %d of '%s' is too long", lineno + 1, infile);
+            ok = false;
+            break;
+        }
+        size_t start = pos;
+        memcpy(line, text + pos, n);
+        line[n] = '\0';
+        pos += n + 1;
+
+        int argc;
+        if (!parse_args(line, argv, &argc)) {
+            ok = false;
+            break;
+        }
+        if (argc == 0) {
+            /* Kept, so that replay echoes it as reading the file would */
+            cbuf_append_word(&code, CFILE_BLANK);
+            cbuf_append_word(&code, 0);
+            nrecords++;
+            continue;
+        }
+
+        cmd_ptr c = find_cmd(argv[0]);
+        if (!c) {
+            report(1, "Unknown command '%s' at line %d of '%s'", argv[0],
+                   lineno + 1, infile);
+            ok = false;
+            break;
+        }
+        if (c->operation == do_comment_cmd && argc > 1) {
+            /* Comment text kept as written, so that replay echoes it */
+            size_t skip = argv[0] - line + strlen(argv[0]);
+            size_t m = n - skip;
+            memcpy(line, text + start + skip, m);
+            while (m && isspace((unsigned char) line[m - 1]))
+                m--;
+            line[m] = '\0';
+            argv[1] = line;
+            argc = 2;
+        }
+        uint32_t op = 0;
+        while (op < nnames && names[op] != c)
+            op++;
+        if (op == nnames) {
+            if (nnames == MAXARGS) {
+                report(1, "Too many distinct commands in '%s'", infile);
+                ok = false;
+                break;
+            }
+            names[nnames++] = c;
+        }
+
+        cbuf_append_word(&code, op);
+        cbuf_append_word(&code, argc - 1);
+        for (int i = 1; i < argc; i++)
+            cbuf_append_word(&code, strpool_intern(&pool, argv[i]));
+        nrecords++;
+    }
+    munmap(text, len);
+
+    FILE *out = NULL;
+    if (ok) {
+        uint32_t name_offs[MAXARGS];
+        for (uint32_t i = 0; i < nnames; i++)
+            name_offs[i] = strpool_intern(&pool, names[i]->name);
+        /* Pad string table, so that records stay word aligned */
+        while (pool.strtab.len % sizeof(uint32_t))
+            cbuf_append(&pool.strtab, "", 1);
+
+        cfile_header header = {
+            .magic = CFILE_MAGIC,
+            .nnames = nnames,
+            .nrecords = nrecords,
+            .strtab_size = pool.strtab.len,
+            .code_size = code.len / sizeof(uint32_t),
+        };
+        out = fopen(outfile, "w");
+        ok = out && fwrite(&header, sizeof(header), 1, out) == 1 &&
+             fwrite(name_offs, sizeof(uint32_t), nnames, out) == nnames &&
+             fwrite(pool.strtab.data, 1, pool.strtab.len, out) ==
+                 pool.strtab.len &&
+             fwrite(code.data, 1, code.len, out) == code.len;
+        if (out && fclose(out))
+            ok = false;
+        if (!ok)
+            report(1, "Could not write compiled file '%s'", outfile);
+        else
+            report(2, "Compiled %u commands from '%s' into '%s'", nrecords,
+                   infile, outfile);
+    }
+
+    if (pool.strtab.data)
+        free_block(pool.strtab.data, pool.strtab.cap);
+    if (pool.slots)
+        free_array(pool.slots, pool.nslots, sizeof(uint32_t));
+    if (code.data)
+        free_block(code.data, code.cap);
+    return ok;
+}
+
+static bool do_compile(int argc, char *argv[])
+{
+    if (argc != 3) {
+        report(1, "%s needs 2 arguments: source and destination files",
+               argv[0]);
+        return false;
+    }
+
+    return compile_file(argv[1], argv[2]);
+}
+
 /* Initialize interpreter */
 void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    memset(cmd_hash, 0, sizeof(cmd_hash));
+    memset(param_hash, 0, sizeof(param_hash));
     err_cnt = 0;
     quit_flag = false;
 
@@ -411,7 +1146,14 @@ void init_cmd()
     ADD_COMMAND(source, " file           | Read commands from source file");
     ADD_COMMAND(log, " file           | Copy output to file");
     ADD_COMMAND(time, " cmd arg ...    | Time command execution");
+    ADD_COMMAND(compile,
+                " file cfile     | Compile command file for replay with -F");
+    ADD_COMMAND(repeat,
+                " N cmd arg ...  | Run command N times, or block up to '}'");
+    ADD_COMMAND(set, " [var val]      | Display or set variables");
+    ADD_COMMAND(inc, " var [delta]    | Add to variable");
     add_cmd("#", do_comment_cmd, " ...            | Display comment");
+    add_cmd("}", do_close_block, "                | End repeat block");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
@@ -433,13 +1175,29 @@ static bool push_file(char *fname)
     if (fd < 0)
         return false;
 
-    if (fd > fd_max)
-        fd_max = fd;
-
     rio_ptr rnew = malloc_or_fail(sizeof(rio_t), "push_file");
     rnew->fd = fd;
     rnew->cnt = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->map_len = 0;
+
+    /* Map regular file so that whole of it is in buffer */
+    struct stat st;
+    if (fname && !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            rnew->map = map;
+            rnew->map_len = st.st_size;
+            rnew->bufptr = map;
+            rnew->cnt = st.st_size;
+        }
+    }
+
+    /* Only input on top of stack is watched */
+    if (buf_stack)
+        event_del(buf_stack->fd);
     rnew->prev = buf_stack;
     buf_stack = rnew;
 
@@ -452,6 +1210,9 @@ static void pop_file()
     if (buf_stack) {
         rio_ptr rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->map)
+            munmap(rsave->map, rsave->map_len);
+        event_del(rsave->fd);
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -468,46 +1229,48 @@ static void init_in()
  */
 static char *readline()
 {
-    int cnt;
-    char c;
     char *lptr = linebuf;
+    /* Leave room for terminating newline and null character */
+    size_t room = RIO_BUFSIZE - 2;
+    bool newline = false;
 
     if (!buf_stack)
         return NULL;
 
-    for (cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
+    while (!newline && room > 0) {
         if (buf_stack->cnt <= 0) {
-            /* Need to read from input file */
-            buf_stack->cnt = read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
-            buf_stack->bufptr = buf_stack->buf;
+            /* Need to read from input file.  Mapped file has no more */
+            if (!buf_stack->map) {
+                buf_stack->cnt =
+                    read(buf_stack->fd, buf_stack->buf, RIO_BLOCKSIZE);
+                buf_stack->bufptr = buf_stack->buf;
+            }
             if (buf_stack->cnt <= 0) {
                 /* Encountered EOF */
                 pop_file();
-                if (cnt > 0) {
-                    /* Last line of file did not terminate with newline. */
-                    /*  Terminate line & return it */
-                    *lptr++ = '\n';
-                    *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
-                    return linebuf;
-                }
-                return NULL;
+                if (lptr == linebuf)
+                    return NULL;
+                /* Last line of file did not terminate with newline. */
+                break;
             }
         }
 
-        /* Have text in buffer */
-        c = *buf_stack->bufptr++;
-        *lptr++ = c;
-        buf_stack->cnt--;
-        if (c == '\n')
-            break;
+        /* Have text in buffer.  Copy up to and including newline */
+        size_t n = buf_stack->cnt < room ? buf_stack->cnt : room;
+        char *eol = memchr(buf_stack->bufptr, '\n', n);
+        if (eol) {
+            n = eol - buf_stack->bufptr + 1;
+            newline = true;
+        }
+        memcpy(lptr, buf_stack->bufptr, n);
+        lptr += n;
+        buf_stack->bufptr += n;
+        buf_stack->cnt -= n;
+        room -= n;
     }
 
-    if (c != '\n') {
-        /* Hit buffer limit.  Artificially terminate line */
+    if (!newline) {
+        /* Hit buffer limit or EOF.  Artificially terminate line */
         *lptr++ = '\n';
     }
     *lptr++ = '\0';
@@ -525,65 +1288,50 @@ static bool cmd_done()
     return !buf_stack || quit_flag;
 }
 
+/* Called by event loop when command input is ready */
+static void cmd_input_ready(int fd, void *data)
+{
+    if (has_infile && buf_stack && buf_stack->fd == fd) {
+        char *cmdline = readline();
+        if (cmdline)
+            interpret_cmd(cmdline);
+    }
+}
+
 /*
- * Handle command processing in program that uses select as main control loop.
- * Like select, but checks whether command input either present in internal
- * buffer
- * or readable from command input.  If so, that command is executed.
- * Same return as select.  Command input file removed from readfds
- *
- * nfds should be set to the maximum file descriptor for network sockets.
- * If nfds == 0, this indicates that there is no pending network activity
+ * Handle command processing in program that uses the event loop as main
+ * control loop.  Wait up to timeout_ms milliseconds (-1 for no limit) for
+ * either command input or input on other descriptors watched by the event
+ * loop, and handle what is ready.
+ * Same return as event_poll.
  */
-int cmd_select(int nfds,
-               fd_set *readfds,
-               fd_set *writefds,
-               fd_set *exceptfds,
-               struct timeval *timeout)
+int cmd_select(int timeout_ms)
 {
-    int infd;
-    fd_set local_readset;
-
     if (cmd_done())
         return 0;
 
-    if (!block_flag) {
-        /* Process any commands in input buffer */
-        if (!readfds)
-            readfds = &local_readset;
-
-        /* Add input fd to readset for select */
-        infd = buf_stack->fd;
-        FD_SET(infd, readfds);
-        if (infd == STDIN_FILENO && prompt_flag) {
-            printf("%s", prompt);
-            fflush(stdout);
-            prompt_flag = true;
-        }
+    if (buf_stack->map) {
+        /* Mapped file is always ready */
+        char *cmdline = readline();
+        if (cmdline)
+            interpret_cmd(cmdline);
+        return 0;
+    }
 
-        if (infd >= nfds)
-            nfds = infd + 1;
+    int infd = buf_stack->fd;
+    if (infd == STDIN_FILENO && prompt_flag) {
+        printf("%s", prompt);
+        fflush(stdout);
+        prompt_flag = true;
     }
-    if (nfds == 0)
-        return 0;
 
-    int result = select(nfds, readfds, writefds, exceptfds, timeout);
-    if (result <= 0)
-        return result;
-
-    infd = buf_stack->fd;
-    if (readfds && FD_ISSET(infd, readfds)) {
-        /* Commandline input available */
-        FD_CLR(infd, readfds);
-        result--;
-        if (has_infile) {
-            char *cmdline;
-            cmdline = readline();
-            if (cmdline)
-                interpret_cmd(cmdline);
-        }
+    if (!event_add(infd, cmd_input_ready, NULL)) {
+        /* Input that cannot be watched, such as empty file, is ready */
+        cmd_input_ready(infd, NULL);
+        return 1;
     }
-    return result;
+
+    return event_poll(timeout_ms);
 }
 
 bool finish_cmd()
@@ -646,18 +1394,622 @@ bool run_console(char *infile_name)
     if (!has_infile) {
         char *cmdline;
         while ((cmdline = linenoise(prompt)) != NULL) {
-            interpret_cmd(cmdline);
-            linenoiseHistoryAdd(cmdline);       /* Add to the history. */
-            linenoiseHistorySave(HISTORY_FILE); /* Save the history on disk. */
+            /* Add to the history before the line is split into arguments */
+            linenoiseHistoryAppend(HISTORY_FILE, cmdline);
+            bool ok = interpret_cmd(cmdline);
             linenoiseFree(cmdline);
             while (buf_stack && buf_stack->fd != STDIN_FILENO)
-                cmd_select(0, NULL, NULL, NULL, NULL);
+                cmd_select(-1);
             has_infile = false;
+            /* Answer the line if it came in a web request */
+            web_done(ok);
         }
     } else {
         while (!cmd_done())
-            cmd_select(0, NULL, NULL, NULL, NULL);
+            cmd_select(-1);
     }
 
     return err_cnt == 0;
 }
+
+/*
+ * Execute compiled command file made by "compile".
+ * Return true if no errors occurred.
+ */
+bool run_compiled(char *cfile_name)
+{
+    size_t len;
+    char *image = map_file(cfile_name, &len, PROT_READ | PROT_WRITE);
+    if (!image || len < sizeof(cfile_header) ||
+        memcmp(image, CFILE_MAGIC, 4)) {
+        report(1, "ERROR: Could not load compiled file '%s'", cfile_name);
+        if (image)
+            munmap(image, len);
+        return false;
+    }
+
+    cfile_header *header = (cfile_header *) image;
+    uint32_t *name_offs = (uint32_t *) (image + sizeof(cfile_header));
+    char *strtab = (char *) (name_offs + header->nnames);
+    uint32_t *code = (uint32_t *) (strtab + header->strtab_size);
+    uint32_t *code_end = code + header->code_size;
+    bool ok = header->nnames <= MAXARGS &&
+              header->strtab_size % sizeof(uint32_t) == 0 &&
+              (char *) code_end == image + len &&
+              (!header->strtab_size || strtab[header->strtab_size - 1] == 0);
+
+    /* Resolve command names */
+    cmd_ptr cmds[MAXARGS];
+    char line[RIO_BUFSIZE];
+    for (uint32_t i = 0; ok && i < header->nnames; i++) {
+        cmds[i] = NULL;
+        if (name_offs[i] < header->strtab_size)
+            cmds[i] = find_cmd(strtab + name_offs[i]);
+        ok = cmds[i] != NULL;
+    }
+
+    /* Check records, so that replay needs no checking */
+    uint32_t nrecords = 0;
+    for (uint32_t *rec = code; ok && rec < code_end; nrecords++) {
+        ok = code_end - rec >= 2 &&
+             (rec[0] < header->nnames || (rec[0] == CFILE_BLANK && !rec[1])) &&
+             rec[1] < MAXARGS && rec[1] <= code_end - rec - 2;
+        for (uint32_t i = 0; ok && i < rec[1]; i++)
+            ok = rec[2 + i] < header->strtab_size;
+        if (ok)
+            rec += 2 + rec[1];
+    }
+    if (!ok || nrecords != header->nrecords) {
+        report(1, "ERROR: Compiled file '%s' is corrupted", cfile_name);
+        munmap(image, len);
+        return false;
+    }
+
+    for (uint32_t *rec = code; rec < code_end && !quit_flag;
+         rec += 2 + rec[1]) {
+        if (rec[0] == CFILE_BLANK) {
+            if (echo) {
+                report_noreturn(1, prompt);
+                report_noreturn(1, "\n");
+            }
+            continue;
+        }
+        cmd_ptr c = cmds[rec[0]];
+        int argc = rec[1] + 1;
+        argv_buf[0] = c->name;
+        for (int i = 1; i < argc; i++)
+            argv_buf[i] = strtab + rec[1 + i];
+
+        /* Comment text is kept as written, see compile_file */
+        bool comment = c->operation == do_comment_cmd && argc == 2;
+        if (echo) {
+            report_noreturn(1, prompt);
+            if (comment)
+                report_noreturn(1, "%s%s", c->name, argv_buf[1]);
+            else
+                for (int i = 0; i < argc; i++)
+                    report_noreturn(1, i ? " %s" : "%s", argv_buf[i]);
+            report_noreturn(1, "\n");
+        }
+        if (comment) {
+            snprintf(line, sizeof(line), "%s%s", c->name, argv_buf[1]);
+            if (!parse_args(line, argv_buf, &argc)) {
+                record_error();
+                continue;
+            }
+        }
+
+        dispatch_cmd(argc, argv_buf, c);
+
+        /* Run any file pushed by "source" */
+        while (!cmd_done())
+            cmd_select(-1);
+    }
+
+    munmap(image, len);
+    return err_cnt == 0;
+}
+
+/*
+ * Server mode.
+ * Clients connect to a UNIX socket and send command lines.  Each client is
+ * served in its own session, with interpreter state of its own, and
+ * application state exchanged by the session helper.  The event loop
+ * serves all sessions.  While a session runs commands, its state is
+ * swapped into the globals and standard output goes to a scratch file.
+ * What was written there is then queued for the client, and sent as the
+ * client takes it, so that a client not reading cannot stall the others.
+ */
+typedef struct {
+    rio_ptr buf_stack;
+    bool has_infile;
+    int err_cnt;
+    int echo;
+    bool quit_flag;
+    bool quit_done;
+    var_ptr var_list;
+    int nest_depth;
+    nest_frame_t nest_stack[MAXNEST];
+    double first_time;
+    double last_time;
+} console_state_t;
+
+typedef struct SESSION_ELE session_ele, *session_ptr;
+struct SESSION_ELE {
+    int fd;                  /* Connected socket */
+    int id;                  /* Number of session, counting from 1 */
+    console_state_t state;   /* Interpreter state while not running */
+    void *app_state;         /* Exchanged by session helper */
+    long cmd_cnt;            /* Commands run */
+    double start;            /* Time of connection */
+    size_t cnt;              /* Bytes in input buffer */
+    char inbuf[RIO_BUFSIZE]; /* Partial command lines */
+    cbuf_t out;              /* Output not yet taken by client */
+    size_t outpos;           /* Bytes of out already sent */
+    bool watch_in;           /* Waiting for commands */
+    bool watch_out;          /* Waiting for client to take output */
+    bool closing;            /* Ended, closing once output is sent */
+    session_ptr next;
+};
+
+/* Stop reading commands of a client leaving this much output untaken */
+#define SESSION_MAXOUT (1 << 20)
+
+static swap_helper_function session_helper = NULL;
+static size_t session_state_size = 0;
+
+static session_ptr session_list = NULL;
+static int session_cnt = 0;
+
+/* Descriptor of standard output of server itself */
+static int server_stdout = -1;
+/* Scratch file collecting standard output of current session */
+static FILE *session_outfile = NULL;
+static volatile sig_atomic_t server_stop = false;
+
+/* Set function exchanging application state with that of a session */
+void set_session_helper(swap_helper_function sf, size_t state_size)
+{
+    session_helper = sf;
+    session_state_size = state_size;
+}
+
+/* Exchange interpreter state with that saved at s */
+static void swap_console(console_state_t *s)
+{
+    console_state_t cur = {
+        .buf_stack = buf_stack,
+        .has_infile = has_infile,
+        .err_cnt = err_cnt,
+        .echo = echo,
+        .quit_flag = quit_flag,
+        .quit_done = quit_done,
+        .var_list = var_list,
+        .nest_depth = nest_depth,
+        .first_time = first_time,
+        .last_time = last_time,
+    };
+    memcpy(cur.nest_stack, nest_stack, sizeof(nest_stack));
+
+    buf_stack = s->buf_stack;
+    has_infile = s->has_infile;
+    err_cnt = s->err_cnt;
+    echo = s->echo;
+    quit_flag = s->quit_flag;
+    quit_done = s->quit_done;
+    var_list = s->var_list;
+    nest_depth = s->nest_depth;
+    memcpy(nest_stack, s->nest_stack, sizeof(nest_stack));
+    first_time = s->first_time;
+    last_time = s->last_time;
+
+    *s = cur;
+}
+
+/* Queue what session wrote to the scratch file as output for its client */
+static void take_output(session_ptr s)
+{
+    int fd = fileno(session_outfile);
+    off_t len = lseek(fd, 0, SEEK_CUR);
+    if (len <= 0)
+        return;
+
+    if (s->outpos) {
+        /* Move unsent output to the front */
+        s->out.len -= s->outpos;
+        memmove(s->out.data, s->out.data + s->outpos, s->out.len);
+        s->outpos = 0;
+    }
+    char buf[RIO_BUFSIZE];
+    off_t off = 0;
+    while (off < len) {
+        ssize_t n = pread(fd, buf, sizeof(buf), off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        cbuf_append(&s->out, buf, n);
+        off += n;
+    }
+    lseek(fd, 0, SEEK_SET);
+    if (ftruncate(fd, 0) < 0)
+        report(1, "WARNING: Could not empty session output file: %s",
+               strerror(errno));
+}
+
+/* Make session current, or stop it being current */
+static void switch_session(session_ptr s, bool enter)
+{
+    fflush(stdout);
+    clearerr(stdout);
+    dup2(enter ? fileno(session_outfile) : server_stdout, STDOUT_FILENO);
+    if (!enter)
+        take_output(s);
+    swap_console(&s->state);
+    if (session_helper)
+        session_helper(s->app_state);
+}
+
+static session_ptr new_session(int fd, int id)
+{
+    session_ptr s = calloc_or_fail(1, sizeof(session_ele), "new_session");
+    s->fd = fd;
+    s->id = id;
+    s->watch_in = true;
+    init_time(&s->state.last_time);
+    s->state.first_time = s->state.last_time;
+    s->start = s->state.last_time;
+    if (session_state_size)
+        s->app_state =
+            calloc_or_fail(1, session_state_size, "new_session");
+    return s;
+}
+
+/* Change which events of session's client the event loop waits for */
+static void watch_session(session_ptr s, bool input, bool output)
+{
+    if (input != s->watch_in || output != s->watch_out) {
+        event_set(s->fd, input, output);
+        s->watch_in = input;
+        s->watch_out = output;
+    }
+}
+
+/*
+ * Send as much pending output of session as its client takes, without
+ * blocking.  Return false if the client is gone.
+ */
+static bool flush_session(session_ptr s)
+{
+    while (s->outpos < s->out.len) {
+        ssize_t n =
+            write(s->fd, s->out.data + s->outpos, s->out.len - s->outpos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+            return false;
+        s->outpos += n;
+    }
+    if (s->outpos == s->out.len)
+        s->outpos = s->out.len = 0;
+
+    size_t pending = s->out.len - s->outpos;
+    watch_session(s, !s->closing && pending < SESSION_MAXOUT, pending > 0);
+    return true;
+}
+
+/* End session, running quit helpers unless "quit" already did */
+static void end_session(session_ptr s)
+{
+    switch_session(s, true);
+    if (!quit_done)
+        do_quit(0, NULL);
+    int errors = err_cnt;
+    switch_session(s, false);
+    s->closing = true;
+
+    double elapsed = delta_time(&s->start);
+    report(1, "Session %d: %ld commands, %d errors in %.3f s (%.0f/s)",
+           s->id, s->cmd_cnt, errors, elapsed,
+           elapsed > 0 ? s->cmd_cnt / elapsed : 0.0);
+}
+
+/* Close connection of ended session, dropping any output not sent */
+static void drop_session(session_ptr s)
+{
+    session_ptr *list = &session_list;
+    while (*list != s)
+        list = &(*list)->next;
+    *list = s->next;
+    event_del(s->fd);
+    close(s->fd);
+    if (s->out.data)
+        free_block(s->out.data, s->out.cap);
+    if (session_state_size)
+        free_block(s->app_state, session_state_size);
+    free_block(s, sizeof(session_ele));
+}
+
+/*
+ * Read input of session and run the complete command lines.
+ * Return false when the session has ended.
+ */
+static bool session_input(session_ptr s)
+{
+    /* Leave room for terminating null character */
+    ssize_t n = read(s->fd, s->inbuf + s->cnt, RIO_BUFSIZE - 1 - s->cnt);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        return true;
+    bool eof = n <= 0;
+    if (!eof)
+        s->cnt += n;
+
+    switch_session(s, true);
+    char *line = s->inbuf;
+    char *end = s->inbuf + s->cnt;
+    while (!quit_flag && line < end) {
+        char *eol = memchr(line, '\n', end - line);
+        if (!eol) {
+            /* Wait for rest of line, unless it cannot come or fit */
+            if (!eof && (line > s->inbuf || s->cnt < RIO_BUFSIZE - 1))
+                break;
+            eol = end;
+        }
+        *eol = '\0';
+        if (echo)
+            report(1, "%s%s", prompt, line);
+        interpret_cmd(line);
+        s->cmd_cnt++;
+
+        /* Run any file pushed by "source" */
+        while (buf_stack && !quit_flag) {
+            char *cmdline = readline();
+            if (cmdline) {
+                interpret_cmd(cmdline);
+                s->cmd_cnt++;
+            }
+        }
+        line = eol < end ? eol + 1 : end;
+    }
+    s->cnt = end - line;
+    memmove(s->inbuf, line, s->cnt);
+    bool done = eof || quit_flag;
+    switch_session(s, false);
+
+    return !done;
+}
+
+/*
+ * Called by event loop when client of session has sent input or can take
+ * output.  An ended session is closed once its output has been sent.
+ */
+static void session_ready(int fd, void *data)
+{
+    session_ptr s = data;
+    bool gone = !flush_session(s);
+    bool ended = gone;
+    if (!gone && s->watch_in)
+        ended = !session_input(s);
+    if (ended && !s->closing)
+        end_session(s);
+    if (!gone)
+        gone = !flush_session(s);
+    if (gone || (s->closing && !s->out.len))
+        drop_session(s);
+}
+
+/* Called by event loop when clients are waiting to connect */
+static void accept_ready(int lfd, void *data)
+{
+    int fd;
+    while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        session_ptr s = new_session(fd, ++session_cnt);
+        s->next = session_list;
+        session_list = s;
+        if (!event_add(fd, session_ready, s)) {
+            end_session(s);
+            drop_session(s);
+        }
+    }
+}
+
+static void server_sighandler(int sig)
+{
+    server_stop = true;
+}
+
+/*
+ * Serve sessions on UNIX socket sock_name until interrupted.
+ * Return true if server could be started.
+ */
+bool run_server(char *sock_name)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(sock_name) >= sizeof(addr.sun_path)) {
+        report(1, "ERROR: Socket name '%s' is too long", sock_name);
+        return false;
+    }
+    strcpy(addr.sun_path, sock_name);
+
+    session_outfile = tmpfile();
+    if (!session_outfile) {
+        report(1, "ERROR: Could not create session output file: %s",
+               strerror(errno));
+        return false;
+    }
+
+    unlink(sock_name);
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(lfd, SOMAXCONN) < 0 || !event_add(lfd, accept_ready, NULL)) {
+        report(1, "ERROR: Could not listen on '%s': %s", sock_name,
+               strerror(errno));
+        if (lfd >= 0)
+            close(lfd);
+        fclose(session_outfile);
+        session_outfile = NULL;
+        return false;
+    }
+
+    /* Interrupt event loop to stop serving, and survive departed clients */
+    struct sigaction sa = {.sa_handler = server_sighandler};
+    struct sigaction old_int, old_term;
+    sigaction(SIGINT, &sa, &old_int);
+    sigaction(SIGTERM, &sa, &old_term);
+    void (*old_pipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+    fflush(stdout);
+    server_stdout = dup(STDOUT_FILENO);
+    serving = true;
+    server_stop = false;
+    report(1, "Serving sessions on '%s'", sock_name);
+
+    while (!server_stop)
+        event_poll(-1);
+
+    /* Send clients what they take right away of their last output */
+    while (session_list) {
+        session_ptr s = session_list;
+        if (!s->closing)
+            end_session(s);
+        flush_session(s);
+        drop_session(s);
+    }
+
+    serving = false;
+    close(server_stdout);
+    fclose(session_outfile);
+    session_outfile = NULL;
+    event_del(lfd);
+    close(lfd);
+    unlink(sock_name);
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    signal(SIGPIPE, old_pipe);
+    return true;
+}
+
+#define MAXWORKERS 64
+
+/* Execute commands received over HTTP until told to stop */
+static bool web_worker(int id, int port)
+{
+    int lfd = web_listen(port, true);
+    if (lfd < 0) {
+        report(1, "ERROR: Worker %d could not listen on port %d: %s", id, port,
+               strerror(errno));
+        return false;
+    }
+    report(2, "Worker %d serving as process %d", id, (int) getpid());
+
+    while (!server_stop && !quit_flag) {
+        event_poll(-1);
+        char *cmdline;
+        while ((cmdline = web_recv())) {
+            bool ok = interpret_cmd(cmdline);
+            free(cmdline);
+            web_done(ok);
+        }
+    }
+    event_del(lfd);
+    close(lfd);
+    return true;
+}
+
+bool run_web(int workers, int port)
+{
+    if (workers < 1 || workers > MAXWORKERS) {
+        report(1, "ERROR: Number of workers must be between 1 and %d",
+               MAXWORKERS);
+        return false;
+    }
+
+    /* Each worker counts its activity in a slot the parent can read */
+    web_stats_t *stats = mmap(NULL, workers * sizeof(web_stats_t),
+                              PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+        report(1, "ERROR: Could not map worker statistics");
+        return false;
+    }
+
+    struct sigaction sa = {.sa_handler = server_sighandler};
+    struct sigaction old_int, old_term;
+    sigaction(SIGINT, &sa, &old_int);
+    sigaction(SIGTERM, &sa, &old_term);
+    void (*old_pipe)(int) = signal(SIGPIPE, SIG_IGN);
+    server_stop = false;
+
+    double start;
+    init_time(&start);
+    fflush(stdout);
+    pid_t pids[MAXWORKERS];
+    int running = 0;
+    for (int i = 0; i < workers; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            /* Worker: the queue inherited from the parent is its own */
+            web_stats = &stats[i];
+            return web_worker(i, port);
+        }
+        if (pids[i] < 0)
+            report(1, "ERROR: Could not start worker %d: %s", i,
+                   strerror(errno));
+        else
+            running++;
+    }
+    report(1, "Serving web requests on port %d with %d workers", port,
+           running);
+
+    /* Wait for interrupt, or for workers to quit by themselves */
+    while (running > 0 && !server_stop) {
+        pid_t pid = wait(NULL);
+        if (pid < 0 && errno != EINTR)
+            break;
+        for (int i = 0; i < workers; i++) {
+            if (pid > 0 && pids[i] == pid) {
+                /* Reaped, so its pid may already belong to another process */
+                pids[i] = 0;
+                running--;
+            }
+        }
+    }
+    /* Stop the workers still running */
+    for (int i = 0; i < workers; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+            waitpid(pids[i], NULL, 0);
+        }
+    }
+    double elapsed = delta_time(&start);
+
+    web_stats_t total = {0};
+    for (int i = 0; i < workers; i++) {
+        report(1,
+               "Worker %d: %zu connections, %zu requests, %zu commands "
+               "(%zu failed), %zu bytes sent",
+               i, stats[i].connections, stats[i].requests, stats[i].commands,
+               stats[i].failed, stats[i].bytes_sent);
+        total.connections += stats[i].connections;
+        total.requests += stats[i].requests;
+        total.commands += stats[i].commands;
+        total.failed += stats[i].failed;
+        total.bytes_sent += stats[i].bytes_sent;
+    }
+    report(1,
+           "Total: %zu connections, %zu requests, %zu commands (%zu failed), "
+           "%zu bytes sent in %.2f s (%.0f requests/s)",
+           total.connections, total.requests, total.commands, total.failed,
+           total.bytes_sent, elapsed,
+           elapsed > 0 ? total.requests / elapsed : 0.0);
+
+    munmap(stats, workers * sizeof(web_stats_t));
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    signal(SIGPIPE, old_pipe);
+    return true;
+}
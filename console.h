@@ -1,7 +1,8 @@
 #ifndef LAB0_CONSOLE_H
 #define LAB0_CONSOLE_H
 #include <stdbool.h>
-#include <sys/select.h>
+#include <stddef.h>
+#include <stdio.h>
 #include "linenoise.h"
 #define HISTORY_FILE ".cmd_history"
 
@@ -15,13 +16,27 @@ typedef bool (*cmd_function)(int argc, char *argv[]);
 
 /* Information about each command */
 
-/* Organized as linked list in alphabetical order */
+/*
+ * Latency of command runs is counted in power-of-two buckets:
+ * bucket 0 holds runs under 1 us, bucket i runs in [2^(i-1), 2^i) us,
+ * and the last bucket everything longer.
+ */
+#define LATENCY_BUCKETS 24
+
+/*
+ * Organized as linked list in alphabetical order,
+ * and chained into hash table for lookup by name
+ */
 typedef struct CELE cmd_ele, *cmd_ptr;
 struct CELE {
     char *name;
     cmd_function operation;
     char *documentation;
     cmd_ptr next;
+    cmd_ptr hash_next; /* Next command in same hash bucket */
+    size_t runs;
+    size_t errors; /* Runs that failed */
+    size_t latency[LATENCY_BUCKETS];
 };
 
 /* Optionally supply function that gets invoked when parameter changes */
@@ -36,6 +51,7 @@ struct PELE {
     /* Function that gets called whenever parameter changes */
     setter_function setter;
     param_ptr next;
+    param_ptr hash_next; /* Next parameter in same hash bucket */
 };
 
 /* Initialize interpreter */
@@ -57,6 +73,19 @@ bool get_int(char *vname, int *loc);
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_function qf);
 
+/*
+ * Optionally supply function that gets invoked around a command run by "time".
+ * Called with done == false before the command and done == true after it.
+ */
+typedef void (*time_helper_function)(bool done);
+void set_time_helper(time_helper_function tf);
+
+/*
+ * Write run counts, error counts and latency histograms of the commands
+ * run so far, as member "commands" of a JSON object.
+ */
+void cmd_stats_json(FILE *out);
+
 /* Turn echoing on/off */
 void set_echo(bool on);
 
@@ -66,19 +95,40 @@ void set_echo(bool on);
 bool finish_cmd();
 
 /*
- * Handle command processing in program that uses select as main
- * control loop.
+ * Handle command processing in program that uses the event loop as main
+ * control loop.  Wait up to timeout_ms milliseconds (-1 for no limit).
  */
-int cmd_select(int nfds,
-               fd_set *readfds,
-               fd_set *writefds,
-               fd_set *exceptfds,
-               struct timeval *timeout);
+int cmd_select(int timeout_ms);
 
 /* Run command loop.  Non-null infile_name implies read commands from that file
  */
 bool run_console(char *infile_name);
 
+/* Execute commands of file produced by "compile" command */
+bool run_compiled(char *cfile_name);
+
+/*
+ * Optionally supply function exchanging the application state with the
+ * one stored at state, letting each session of the server have its own.
+ * The state of a new session is state_size zero bytes.
+ */
+typedef void (*swap_helper_function)(void *state);
+void set_session_helper(swap_helper_function sf, size_t state_size);
+
+/*
+ * Serve clients connecting to UNIX socket sock_name until interrupted,
+ * each in a separate session.  Return true if server could be started.
+ */
+bool run_server(char *sock_name);
+
+/*
+ * Serve web requests on port with worker processes, each executing the
+ * commands it receives against application state of its own, until
+ * interrupted.  Both the workers and the parent, which reports their
+ * combined activity, return from it.  Return true if serving went well.
+ */
+bool run_web(int workers, int port);
+
 /* Callback function to complete command by linenoise */
 void completion(const char *buf, linenoiseCompletions *lc);
 
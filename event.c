@@ -0,0 +1,107 @@
+/* Event loop on epoll */
+
+#include "event.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define MAXEVENTS 64
+
+typedef struct {
+    event_handler handler; /* NULL when descriptor not watched */
+    void *data;
+} watch_t;
+
+static int epfd = -1;
+
+/* Watches indexed by descriptor */
+static watch_t *watches = NULL;
+static int nwatches = 0;
+
+bool event_add(int fd, event_handler handler, void *data)
+{
+    if (fd < 0)
+        return false;
+
+    if (fd < nwatches && watches[fd].handler) {
+        watches[fd].handler = handler;
+        watches[fd].data = data;
+        return true;
+    }
+
+    if (epfd < 0) {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0)
+            return false;
+    }
+
+    if (fd >= nwatches) {
+        int n = nwatches ? nwatches : 16;
+        while (n <= fd)
+            n *= 2;
+        watch_t *w = realloc(watches, n * sizeof(watch_t));
+        if (!w)
+            return false;
+        memset(w + nwatches, 0, (n - nwatches) * sizeof(watch_t));
+        watches = w;
+        nwatches = n;
+    }
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        return false;
+    watches[fd].handler = handler;
+    watches[fd].data = data;
+    return true;
+}
+
+bool event_set(int fd, bool input, bool output)
+{
+    if (fd < 0 || fd >= nwatches || !watches[fd].handler)
+        return false;
+
+    struct epoll_event ev = {
+        .events = (input ? EPOLLIN : 0) | (output ? EPOLLOUT : 0),
+        .data.fd = fd,
+    };
+    return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void event_del(int fd)
+{
+    if (fd < 0 || fd >= nwatches || !watches[fd].handler)
+        return;
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    watches[fd].handler = NULL;
+    watches[fd].data = NULL;
+}
+
+int event_poll(int timeout_ms)
+{
+    if (epfd < 0)
+        return 0;
+
+    struct epoll_event events[MAXEVENTS];
+    int n = epoll_wait(epfd, events, MAXEVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno != EINTR)
+            perror("epoll_wait");
+        return -1;
+    }
+
+    int called = 0;
+    for (int i = 0; i < n; i++) {
+        /* Handlers may remove watches of later events */
+        int fd = events[i].data.fd;
+        if (fd < nwatches && watches[fd].handler) {
+            watches[fd].handler(fd, watches[fd].data);
+            called++;
+        }
+    }
+    return called;
+}
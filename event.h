@@ -0,0 +1,39 @@
+#ifndef LAB0_EVENT_H
+#define LAB0_EVENT_H
+
+#include <stdbool.h>
+
+/*
+ * Event loop shared by the console, the line editor and the web server.
+ * Descriptors are watched for input, and optionally for room to write
+ * output, through one epoll instance.  Each has a handler that is called
+ * when it is ready.
+ */
+
+/* Function called with the registered data when fd is ready */
+typedef void (*event_handler)(int fd, void *data);
+
+/*
+ * Watch fd for input, or replace its handler if already watched.
+ * Return false if fd cannot be watched, e.g. a regular file.
+ */
+bool event_add(int fd, event_handler handler, void *data);
+
+/*
+ * Choose whether the handler of watched fd is called when fd has input,
+ * and when it can take output.  Watching starts with input only.
+ * Return false if fd is not watched.
+ */
+bool event_set(int fd, bool input, bool output);
+
+/* Stop watching fd.  Must be called before fd is closed */
+void event_del(int fd);
+
+/*
+ * Wait up to timeout_ms milliseconds (-1 for no limit) for input on the
+ * watched descriptors, and call the handlers of those ready.
+ * Return number of handlers called, or -1 on error.
+ */
+int event_poll(int timeout_ms);
+
+#endif /* LAB0_EVENT_H */
@@ -1,12 +1,18 @@
 /* Test support code */
 
+#include <malloc.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "random.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -24,6 +30,12 @@
 /* Value at end of every block */
 #define MAGICFOOTER 0xbeefdead
 
+/*
+ * Value just before payload of blocks placed against a guard page,
+ * preceded by the address of their header
+ */
+#define MAGICGUARD 0xfeedface
+
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
@@ -36,30 +48,67 @@
 typedef struct BELE {
     struct BELE *next, *prev;
     size_t payload_size;
+    size_t alignment;    /* Requested payload alignment, 0 for default */
+    size_t map_size;     /* Bytes mapped before guard page, 0 if none */
     size_t magic_header; /* Marker to see if block seems legitimate */
-    unsigned char payload[0];
+    _Alignas(max_align_t) unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_ele_t;
 
 static block_ele_t *allocated = NULL;
 static size_t allocated_count = 0;
 
+/*
+ * Guard-page mode.
+ * Each block gets its own mapping with the header at the start and the
+ * payload ending right at an inaccessible page, so overruns fault at the
+ * offending instruction.  Mappings are recycled through per-size pools.
+ */
+int guard_mode = 0;
+
+#define GUARD_POOL_PAGES 8
+#define GUARD_POOL_MAX 1024
+static block_ele_t *guard_pool[GUARD_POOL_PAGES];
+static size_t guard_pool_cnt[GUARD_POOL_PAGES];
+
+/* Allocation statistics, updated by test_malloc and test_free */
+static memstat_t memstat;
+
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* Fail every n-th allocation attempt, 0 to disable */
+int fail_nth = 0;
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
 static bool error_occurred = false;
 static char *error_message = "";
 
-static int time_limit = 1;
+/* Time budget of each risky operation in milliseconds, 0 for none */
+int time_limit_ms = 1000;
 
 /*
  * Data for managing exceptions
  */
-static jmp_buf env;
+static sigjmp_buf env;
 static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+static volatile sig_atomic_t time_limited = false;
+
+/*
+ * Watchdog.
+ * A periodic timer delivers SIGALRM WATCHDOG_TICKS times per time budget
+ * while risky operations run.  Starting an operation only records the
+ * current tick; the timer is armed when the first operation starts and
+ * disarms itself on the first tick after operations have stopped.
+ */
+#define WATCHDOG_TICKS 10
+static timer_t watchdog;
+static bool watchdog_created = false;
+static long watchdog_period = 0; /* Tick period in nanoseconds */
+static volatile sig_atomic_t watchdog_armed = false;
+static volatile sig_atomic_t watchdog_ticks = 0;
+static volatile sig_atomic_t watchdog_start = 0;
 
 /*
  * Internal functions
@@ -68,8 +117,65 @@ static bool time_limited = false;
 /* Should this allocation fail? */
 static bool fail_allocation()
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    static int last_nth = 0;
+    static int attempts = 0;
+    if (fail_nth != last_nth) {
+        /* Schedule changed, start counting anew */
+        last_nth = fail_nth;
+        attempts = 0;
+    }
+    if (fail_nth > 0 && ++attempts == fail_nth) {
+        attempts = 0;
+        return true;
+    }
+
+    if (!fail_probability)
+        return false;
+    /* Compare upper 32 random bits against percentage scaled by 2^32 */
+    return (prng_next() >> 32) * 100 < (uint64_t) fail_probability << 32;
+}
+
+/* Index of power-of-two histogram bucket holding allocations of size bytes */
+static int memstat_bucket(size_t size)
+{
+    if (!size)
+        return 0;
+    int bucket = 8 * sizeof(unsigned long) - __builtin_clzl(size);
+    return bucket < MEMSTAT_BUCKETS ? bucket : MEMSTAT_BUCKETS - 1;
+}
+
+static void memstat_alloc(size_t size)
+{
+    memstat.alloc_cnt++;
+    memstat.alloc_bytes += size;
+    memstat.current_bytes += size;
+    if (memstat.current_bytes > memstat.peak_bytes)
+        memstat.peak_bytes = memstat.current_bytes;
+    memstat.histogram[memstat_bucket(size)]++;
+}
+
+static void memstat_free(size_t size)
+{
+    memstat.free_cnt++;
+    memstat.free_bytes += size;
+    memstat.current_bytes -= size;
+}
+
+/* Block resized in place, which is neither an allocation nor a free */
+static void memstat_resize(size_t old_size, size_t new_size)
+{
+    memstat.resize_cnt++;
+    memstat.current_bytes += new_size - old_size;
+    if (memstat.current_bytes > memstat.peak_bytes)
+        memstat.peak_bytes = memstat.current_bytes;
+}
+
+static size_t page_size()
+{
+    static size_t size = 0;
+    if (!size)
+        size = sysconf(_SC_PAGESIZE);
+    return size;
 }
 
 /*
@@ -83,7 +189,16 @@ static block_ele_t *find_header(void *p)
         error_occurred = true;
     }
 
-    block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
+    /* Payload may be unaligned in guard-page mode */
+    size_t marker;
+    memcpy(&marker, (void *) ((size_t) p - sizeof(size_t)), sizeof(size_t));
+
+    block_ele_t *b;
+    if (marker == MAGICGUARD)
+        memcpy(&b, (void *) ((size_t) p - 2 * sizeof(size_t)),
+               sizeof(block_ele_t *));
+    else
+        b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
         block_ele_t *ab = allocated;
@@ -120,47 +235,186 @@ static size_t *find_footer(block_ele_t *b)
 }
 
 /*
- * Implementation of application functions
+ * Distance from start of underlying allocation to block header.
+ * Nonzero only when payload must be aligned beyond what malloc provides.
  */
-void *test_malloc(size_t size)
+static size_t block_offset(size_t alignment)
+{
+    if (alignment <= _Alignof(max_align_t))
+        return 0;
+    size_t hsize = (sizeof(block_ele_t) + alignment - 1) & ~(alignment - 1);
+    return hsize - sizeof(block_ele_t);
+}
+
+/* Given pointer to block, find start of underlying allocation */
+static void *find_base(block_ele_t *b)
+{
+    return (void *) ((size_t) b - block_offset(b->alignment));
+}
+
+/*
+ * Alignment of payload placed against a guard page.  Without one asked
+ * for, it must still be what malloc guarantees, at the cost of a few
+ * bytes between payload and guard page.
+ */
+static size_t guard_alignment(size_t alignment)
+{
+    return alignment ? alignment : _Alignof(max_align_t);
+}
+
+/* Given pointer to block, find its payload */
+static unsigned char *find_payload(block_ele_t *b)
+{
+    if (!b->map_size)
+        return b->payload;
+
+    size_t align = guard_alignment(b->alignment);
+    return (unsigned char *) (((size_t) b + b->map_size - b->payload_size) &
+                              ~(align - 1));
+}
+
+/*
+ * Get mapping of map_size bytes followed by an inaccessible guard page,
+ * preferably from the pool of released ones
+ */
+static block_ele_t *map_guarded(size_t map_size)
+{
+    size_t pages = map_size / page_size();
+    if (pages <= GUARD_POOL_PAGES && guard_pool[pages - 1]) {
+        block_ele_t *b = guard_pool[pages - 1];
+        guard_pool[pages - 1] = b->next;
+        guard_pool_cnt[pages - 1]--;
+        return b;
+    }
+
+    void *base = mmap(NULL, map_size + page_size(), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (mprotect((void *) ((size_t) base + map_size), page_size(),
+                 PROT_NONE)) {
+        munmap(base, map_size + page_size());
+        return NULL;
+    }
+    return base;
+}
+
+/* Return mapping of guarded block to the pool, or unmap it if pool is full */
+static void unmap_guarded(block_ele_t *b)
+{
+    size_t pages = b->map_size / page_size();
+    if (pages <= GUARD_POOL_PAGES &&
+        guard_pool_cnt[pages - 1] < GUARD_POOL_MAX) {
+        b->next = guard_pool[pages - 1];
+        guard_pool[pages - 1] = b;
+        guard_pool_cnt[pages - 1]++;
+        return;
+    }
+    munmap(b, b->map_size + page_size());
+}
+
+/* Check and report any allocation restriction on the current request */
+static bool allocation_allowed()
 {
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to malloc disallowed");
-        return NULL;
+        return false;
     }
 
     if (fail_allocation()) {
         report_event(MSG_WARN, "Malloc returning NULL");
-        return NULL;
-    }
-
-    block_ele_t *new_block =
-        malloc(size + sizeof(block_ele_t) + sizeof(size_t));
-    if (!new_block) {
-        report_event(MSG_FATAL, "Couldn't allocate any more memory");
-        error_occurred = true;
+        return false;
     }
+    return true;
+}
 
-    // cppcheck-suppress nullPointerRedundantCheck
+/* Add block to list of allocated blocks and return its payload */
+static void *link_block(block_ele_t *new_block, size_t size, size_t alignment)
+{
     new_block->magic_header = MAGICHEADER;
-    // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
-    *find_footer(new_block) = MAGICFOOTER;
-    void *p = (void *) &new_block->payload;
-    memset(p, FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
+    new_block->alignment = alignment;
     new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
     new_block->prev = NULL;
 
     if (allocated)
         allocated->prev = new_block;
     allocated = new_block;
     allocated_count++;
+    memstat_alloc(size);
 
+    return find_payload(new_block);
+}
+
+/*
+ * Allocate block whose payload ends at a guard page.
+ * No footer or fill pattern is needed, since any access past the payload
+ * faults immediately.
+ */
+static void *alloc_guarded(size_t size, size_t alignment)
+{
+    size_t align = guard_alignment(alignment);
+    size_t need = sizeof(block_ele_t) + 2 * sizeof(size_t) + size + align - 1;
+    size_t map_size = (need + page_size() - 1) & ~(page_size() - 1);
+    block_ele_t *new_block = map_guarded(map_size);
+    if (!new_block) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+    }
+
+    // cppcheck-suppress nullPointerRedundantCheck
+    new_block->map_size = map_size;
+    void *p = link_block(new_block, size, alignment);
+    size_t marker = MAGICGUARD;
+    memcpy((void *) ((size_t) p - 2 * sizeof(size_t)), &new_block,
+           sizeof(block_ele_t *));
+    memcpy((void *) ((size_t) p - sizeof(size_t)), &marker, sizeof(size_t));
     return p;
 }
 
+/*
+ * Allocate new block holding size bytes of payload aligned to alignment,
+ * and add it to list of allocated blocks
+ */
+static void *alloc_block(size_t size, size_t alignment)
+{
+    if (guard_mode)
+        return alloc_guarded(size, alignment);
+
+    size_t offset = block_offset(alignment);
+    size_t total = offset + size + sizeof(block_ele_t) + sizeof(size_t);
+    void *base = NULL;
+    if (offset) {
+        if (posix_memalign(&base, alignment, total))
+            base = NULL;
+    } else {
+        base = malloc(total);
+    }
+    if (!base) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+    }
+
+    block_ele_t *new_block = (block_ele_t *) ((size_t) base + offset);
+    // cppcheck-suppress nullPointerRedundantCheck
+    new_block->map_size = 0;
+    void *p = link_block(new_block, size, alignment);
+    *find_footer(new_block) = MAGICFOOTER;
+    memset(p, FILLCHAR, size);
+    return p;
+}
+
+/*
+ * Implementation of application functions
+ */
+void *test_malloc(size_t size)
+{
+    if (!allocation_allowed())
+        return NULL;
+
+    return alloc_block(size, 0);
+}
+
 // cppcheck-suppress unusedFunction
 void *test_calloc(size_t nelem, size_t elsize)
 {
@@ -184,17 +438,23 @@ void test_free(void *p)
         return;
 
     block_ele_t *b = find_header(p);
-    size_t footer = *find_footer(b);
-    if (footer != MAGICFOOTER) {
-        report_event(MSG_ERROR,
-                     "Corruption detected in block with address %p when "
-                     "attempting to free it",
-                     p);
-        error_occurred = true;
+    if (!b->map_size) {
+        size_t footer = *find_footer(b);
+        if (footer != MAGICFOOTER) {
+            report_event(MSG_ERROR,
+                         "Corruption detected in block with address %p when "
+                         "attempting to free it",
+                         p);
+            error_occurred = true;
+        }
+        *find_footer(b) = MAGICFREE;
+        memset(p, FILLCHAR, b->payload_size);
+    } else {
+        size_t marker = MAGICFREE;
+        memcpy((void *) ((size_t) p - sizeof(size_t)), &marker,
+               sizeof(size_t));
     }
     b->magic_header = MAGICFREE;
-    *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
 
     /* Unlink from list */
     block_ele_t *bn = b->next;
@@ -206,10 +466,83 @@ void test_free(void *p)
     if (bn)
         bn->prev = bp;
 
-    free(b);
+    memstat_free(b->payload_size);
+    if (b->map_size)
+        unmap_guarded(b);
+    else
+        free(find_base(b));
     allocated_count--;
 }
 
+/*
+ * Resize block.  Grow or shrink in place when the underlying allocation has
+ * room for the new size, otherwise move contents to a new block keeping the
+ * alignment of the original one.  Blocks placed against a guard page are
+ * always moved, so that the new payload ends at the guard page again.
+ */
+// cppcheck-suppress unusedFunction
+void *test_realloc(void *p, size_t size)
+{
+    if (!p)
+        return test_malloc(size);
+
+    if (!size) {
+        test_free(p);
+        return NULL;
+    }
+
+    if (!allocation_allowed())
+        return NULL;
+
+    block_ele_t *b = find_header(p);
+    if (!b->map_size && *find_footer(b) != MAGICFOOTER) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to reallocate it",
+                     p);
+        error_occurred = true;
+    }
+
+    size_t old_size = b->payload_size;
+    size_t room = 0;
+    if (!b->map_size)
+        room = malloc_usable_size(find_base(b)) - block_offset(b->alignment) -
+               sizeof(block_ele_t) - sizeof(size_t);
+    if (size <= room) {
+        if (size > old_size)
+            memset((unsigned char *) p + old_size, FILLCHAR, size - old_size);
+        b->payload_size = size;
+        *find_footer(b) = MAGICFOOTER;
+        memstat_resize(old_size, size);
+        return p;
+    }
+
+    void *q = alloc_block(size, b->alignment);
+    memcpy(q, p, old_size);
+    test_free(p);
+    return q;
+}
+
+/*
+ * Allocate block whose payload address is a multiple of alignment,
+ * which must be a power of two
+ */
+// cppcheck-suppress unusedFunction
+void *test_aligned_alloc(size_t alignment, size_t size)
+{
+    if (!alignment || (alignment & (alignment - 1))) {
+        report_event(MSG_ERROR, "Alignment %lu is not a power of two",
+                     alignment);
+        error_occurred = true;
+        return NULL;
+    }
+
+    if (!allocation_allowed())
+        return NULL;
+
+    return alloc_block(size, alignment);
+}
+
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
 {
@@ -226,10 +559,68 @@ size_t allocation_check()
     return allocated_count;
 }
 
+void swap_allocation_count(size_t *cntp)
+{
+    size_t cnt = allocated_count;
+    allocated_count = *cntp;
+    *cntp = cnt;
+}
+
 /*
  * Implementation of functions for testing
  */
 
+/* Copy current allocation statistics into stat */
+void memstat_get(memstat_t *stat)
+{
+    *stat = memstat;
+}
+
+/*
+ * Restart allocation statistics.
+ * Live bytes are kept, since blocks allocated earlier are still in use.
+ */
+void memstat_reset()
+{
+    size_t current_bytes = memstat.current_bytes;
+    memset(&memstat, 0, sizeof(memstat));
+    memstat.current_bytes = memstat.peak_bytes = current_bytes;
+}
+
+/*
+ * Report allocation activity since snapshot base was taken,
+ * or since the last reset when base is NULL.
+ */
+void memstat_report(int vlevel, const memstat_t *base)
+{
+    memstat_t zero = {0};
+    if (!base)
+        base = &zero;
+
+    report(vlevel, "Allocations = %lu (%lu bytes), Frees = %lu (%lu bytes)",
+           memstat.alloc_cnt - base->alloc_cnt,
+           memstat.alloc_bytes - base->alloc_bytes,
+           memstat.free_cnt - base->free_cnt,
+           memstat.free_bytes - base->free_bytes);
+    report(vlevel, "Resizes in place = %lu",
+           memstat.resize_cnt - base->resize_cnt);
+    report(vlevel, "Live bytes = %lu, Peak live bytes = %lu",
+           memstat.current_bytes, memstat.peak_bytes);
+
+    for (int i = 0; i < MEMSTAT_BUCKETS; i++) {
+        size_t cnt = memstat.histogram[i] - base->histogram[i];
+        if (!cnt)
+            continue;
+        if (i == 0)
+            report(vlevel, "\t[0, 1)\t%lu", cnt);
+        else if (i == MEMSTAT_BUCKETS - 1)
+            report(vlevel, "\t[%lu, inf)\t%lu", 1UL << (i - 1), cnt);
+        else
+            report(vlevel, "\t[%lu, %lu)\t%lu", 1UL << (i - 1), 1UL << i,
+                   cnt);
+    }
+}
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -258,19 +649,79 @@ bool error_check()
     return e;
 }
 
+/* Set timer to tick with period watchdog_period, or stop it when 0 */
+static void watchdog_set(long period)
+{
+    struct itimerspec its = {
+        .it_interval = {period / 1000000000L, period % 1000000000L},
+        .it_value = {period / 1000000000L, period % 1000000000L},
+    };
+    timer_settime(watchdog, 0, &its, NULL);
+}
+
+/* Make sure watchdog ticks at the rate required by current time budget */
+static void watchdog_arm()
+{
+    long period = time_limit_ms * 1000000L / WATCHDOG_TICKS;
+    if (watchdog_armed && period == watchdog_period)
+        return;
+
+    if (!watchdog_created) {
+        struct sigevent sev = {
+            .sigev_notify = SIGEV_SIGNAL,
+            .sigev_signo = SIGALRM,
+        };
+        if (timer_create(CLOCK_MONOTONIC, &sev, &watchdog)) {
+            report_event(MSG_WARN, "Cannot create watchdog timer");
+            return;
+        }
+        watchdog_created = true;
+    }
+
+    watchdog_period = period;
+    watchdog_armed = true;
+    watchdog_set(period);
+}
+
+/*
+ * Account for one watchdog tick.  Called from SIGALRM handler.
+ * Return true when the running operation has exceeded its time budget.
+ */
+bool watchdog_tick()
+{
+    if (!time_limited) {
+        /*
+         * Nothing to watch, stop ticking until next operation, so that
+         * an idle console or server is not woken up
+         */
+        if (watchdog_armed) {
+            watchdog_armed = false;
+            watchdog_set(0);
+        }
+        return false;
+    }
+
+    watchdog_ticks++;
+    return watchdog_ticks - watchdog_start > WATCHDOG_TICKS;
+}
+
 /*
  * Prepare for a risky operation using setjmp.
  * Function returns true for initial return, false for error return
  */
 bool exception_setup(bool limit_time)
 {
-    if (sigsetjmp(env, 1)) {
+    /* Signal mask is not saved, to keep the common path free of syscalls */
+    if (sigsetjmp(env, 0)) {
         /* Got here from longjmp */
         jmp_ready = false;
-        if (time_limited) {
-            alarm(0);
-            time_limited = false;
-        }
+        time_limited = false;
+
+        /* SIGALRM stays blocked when jumping out of its handler */
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGALRM);
+        sigprocmask(SIG_UNBLOCK, &mask, NULL);
 
         if (error_message)
             report_event(MSG_ERROR, error_message);
@@ -280,9 +731,10 @@ bool exception_setup(bool limit_time)
 
     /* Got here from initial call */
     jmp_ready = true;
-    if (limit_time) {
-        alarm(time_limit);
+    if (limit_time && time_limit_ms > 0) {
+        watchdog_start = watchdog_ticks;
         time_limited = true;
+        watchdog_arm();
     }
     return true;
 }
@@ -292,11 +744,7 @@ bool exception_setup(bool limit_time)
  */
 void exception_cancel()
 {
-    if (time_limited) {
-        alarm(0);
-        time_limited = false;
-    }
-
+    time_limited = false;
     jmp_ready = false;
     error_message = "";
 }
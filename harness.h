@@ -15,16 +15,65 @@ void *test_malloc(size_t size);
 void *test_calloc(size_t nmemb, size_t size);
 void test_free(void *p);
 char *test_strdup(const char *s);
-/* FIXME: provide test_realloc as well */
+void *test_realloc(void *p, size_t size);
+void *test_aligned_alloc(size_t alignment, size_t size);
 
 #ifdef INTERNAL
 
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/*
+ * Exchange number of allocated blocks with *cntp,
+ * so that each of several queues can have its blocks counted separately
+ */
+void swap_allocation_count(size_t *cntp);
+
+/*
+ * Allocation statistics collected by test_malloc and test_free.
+ * Allocation sizes are counted in power-of-two buckets:
+ * bucket 0 holds zero-byte requests, bucket i holds sizes in [2^(i-1), 2^i).
+ */
+#define MEMSTAT_BUCKETS 32
+typedef struct {
+    size_t alloc_cnt;
+    size_t alloc_bytes;
+    size_t free_cnt;
+    size_t free_bytes;
+    size_t resize_cnt;    /* Blocks resized in place by realloc */
+    size_t current_bytes; /* Payload bytes currently allocated */
+    size_t peak_bytes;    /* Maximum of current_bytes since last reset */
+    size_t histogram[MEMSTAT_BUCKETS];
+} memstat_t;
+
+/* Copy current allocation statistics into stat */
+void memstat_get(memstat_t *stat);
+
+/* Restart allocation statistics */
+void memstat_reset();
+
+/*
+ * Report allocation activity since snapshot base was taken,
+ * or since the last reset when base is NULL.
+ */
+void memstat_report(int vlevel, const memstat_t *base);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/*
+ * Make every n-th allocation attempt fail (0 to disable).
+ * Counting restarts whenever the value changes.
+ */
+extern int fail_nth;
+
+/*
+ * Nonzero to place each allocation against an inaccessible guard page,
+ * trapping overruns when they happen instead of when the block is freed.
+ * Every block takes its own mapping, so keep queues small in this mode.
+ */
+extern int guard_mode;
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -42,12 +91,23 @@ void set_noallocate_mode(bool noallocate);
  */
 bool error_check();
 
+/* Time budget of each risky operation in milliseconds, 0 for none */
+extern int time_limit_ms;
+
 /*
  * Prepare for a risky operation using setjmp.
+ * When limit_time is set, the operation is watched by a periodic timer
+ * delivering SIGALRM, whose handler must call watchdog_tick.
  * Function returns true for initial return, false for error return
  */
 bool exception_setup(bool limit_time);
 
+/*
+ * Account for one tick of the watchdog timer.
+ * Return true when the running operation has exceeded its time budget.
+ */
+bool watchdog_tick();
+
 /*
  * Call once past risky code
  */
@@ -63,6 +123,8 @@ void trigger_exception(char *msg);
 /* Tested program use our versions of malloc and free */
 #define malloc test_malloc
 #define free test_free
+#define realloc test_realloc
+#define aligned_alloc test_aligned_alloc
 
 /* Use undef to avoid strdup redefined error */
 #undef strdup
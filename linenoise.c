@@ -104,14 +104,17 @@
  */
 
 #include "linenoise.h"
+#include "event.h"
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
 
@@ -129,8 +132,22 @@ static int mlmode = 0;  /* Multi line mode. Default is single line. */
 static int atexit_registered = 0; /* Register atexit just 1 time. */
 static int history_max_len = LINENOISE_DEFAULT_HISTORY_MAX_LEN;
 static int history_len = 0;
+static int history_start = 0; /* Index of oldest entry in ring buffer. */
 static char **history = NULL;
 
+/* Journal file that added history lines are appended to. */
+static char *journal_name = NULL;
+static int journal_fd = -1;
+static int journal_lines = 0; /* Lines in the journal file. */
+
+/* Keys read from the terminal in blocks, then consumed one at a time. */
+static char inbuf[256];
+static int inbufLen = 0;
+static int inbufPos = 0;
+
+/* Set by the event loop when the terminal has input. */
+static int keyReady = 0;
+
 /* The linenoiseState structure represents the state during line editing.
  * We pass this state to functions implementing specific editing
  * functionalities. */
@@ -147,8 +164,16 @@ struct linenoiseState {
     size_t cols;        /* Number of columns in terminal. */
     size_t maxrows;     /* Maximum num of rows used so far (multiline mode) */
     int history_index;  /* The history index we are currently editing. */
+    int shownok;        /* Whether shownText matches the screen. */
+    size_t shownoff;    /* Buffer offset of the first shown character. */
+    size_t shownlen;    /* Number of buffer characters on screen. */
+    size_t showncol;    /* Cursor column after the last refresh. */
 };
 
+/* Buffer characters displayed after the prompt by the last single line
+ * refresh, so that the next one only rewrites what changed. */
+static char shownText[LINENOISE_MAX_LINE];
+
 enum KEY_ACTION {
     KEY_NULL = 0,   /* NULL */
     CTRL_A = 1,     /* Ctrl+a */
@@ -173,6 +198,7 @@ enum KEY_ACTION {
 
 static void linenoiseAtExit(void);
 int linenoiseHistoryAdd(const char *line);
+static char **historyAt(int i);
 static void refreshLine(struct linenoiseState *l);
 
 /* Debugging macro. */
@@ -379,6 +405,27 @@ static void freeCompletions(linenoiseCompletions *lc)
         free(lc->cvec);
 }
 
+/* Read one key from fd, calling read() only when no key is buffered.
+ * Same return as read() with a count of 1. */
+static int readByte(int fd, char *c)
+{
+    if (inbufPos == inbufLen) {
+        int nread = read(fd, inbuf, sizeof(inbuf));
+        if (nread <= 0)
+            return nread;
+        inbufLen = nread;
+        inbufPos = 0;
+    }
+    *c = inbuf[inbufPos++];
+    return 1;
+}
+
+/* Event loop handler recording that input is ready. */
+static void inputReady(int fd, void *data)
+{
+    *(int *) data = 1;
+}
+
 /* This is an helper function for linenoiseEdit() and is called when the
  * user types the <tab> key in order to complete the string currently in the
  * input.
@@ -412,7 +459,7 @@ static int completeLine(struct linenoiseState *ls)
                 refreshLine(ls);
             }
 
-            nread = read(ls->ifd, &c, 1);
+            nread = readByte(ls->ifd, &c);
             if (nread <= 0) {
                 freeCompletions(&lc);
                 return -1;
@@ -497,28 +544,69 @@ void linenoiseAddCompletion(linenoiseCompletions *lc, const char *str)
 struct abuf {
     char *b;
     int len;
+    int cap;
 };
 
+#define ABUF_INIT 256
+
+/* The output buffer is kept across refreshes, so that after the first few
+ * keystrokes no allocation happens while editing: it only grows, by
+ * doubling, when a longer line than ever before has to be drawn. */
+static struct abuf outbuf;
+
 static void abInit(struct abuf *ab)
 {
-    ab->b = NULL;
     ab->len = 0;
 }
 
 static void abAppend(struct abuf *ab, const char *s, int len)
 {
-    char *new = realloc(ab->b, ab->len + len);
-
-    if (new == NULL)
-        return;
-    memcpy(new + ab->len, s, len);
-    ab->b = new;
+    if (ab->len + len > ab->cap) {
+        int cap = ab->cap ? ab->cap : ABUF_INIT;
+        while (cap < ab->len + len)
+            cap *= 2;
+        char *new = realloc(ab->b, cap);
+        if (new == NULL)
+            return;
+        ab->b = new;
+        ab->cap = cap;
+    }
+    memcpy(ab->b + ab->len, s, len);
     ab->len += len;
 }
 
 static void abFree(struct abuf *ab)
 {
     free(ab->b);
+    ab->b = NULL;
+    ab->len = ab->cap = 0;
+}
+
+/* Move the cursor from column 'from' to column 'to' of the current row,
+ * using whichever of a relative or an absolute move is shorter.  A cursor
+ * past the last column may be pending a wrap, so it is always placed
+ * absolutely. */
+static void abMoveCursor(struct abuf *ab, size_t from, size_t to, size_t cols)
+{
+    char rel[32], abs[32];
+    int rlen, alen;
+
+    if (from == to)
+        return;
+    alen = to ? snprintf(abs, sizeof(abs), "\r\x1b[%dC", (int) to)
+              : snprintf(abs, sizeof(abs), "\r");
+    if (from >= cols) {
+        abAppend(ab, abs, alen);
+        return;
+    }
+    if (to > from)
+        rlen = snprintf(rel, sizeof(rel), "\x1b[%dC", (int) (to - from));
+    else
+        rlen = snprintf(rel, sizeof(rel), "\x1b[%dD", (int) (from - to));
+    if (rlen <= alen)
+        abAppend(ab, rel, rlen);
+    else
+        abAppend(ab, abs, alen);
 }
 
 /* Helper of refreshSingleLine() and refreshMultiLine() to show hints
@@ -563,7 +651,7 @@ static void refreshSingleLine(struct linenoiseState *l)
     char *buf = l->buf;
     size_t len = l->len;
     size_t pos = l->pos;
-    struct abuf ab;
+    struct abuf *ab = &outbuf;
 
     while ((plen + pos) >= l->cols) {
         buf++;
@@ -574,29 +662,62 @@ static void refreshSingleLine(struct linenoiseState *l)
         len--;
     }
 
-    abInit(&ab);
-    /* Cursor to left edge */
-    snprintf(seq, 64, "\r");
-    abAppend(&ab, seq, strlen(seq));
-    /* Write the prompt and the current buffer content */
-    abAppend(&ab, l->prompt, strlen(l->prompt));
-    if (maskmode == 1) {
-        while (len--)
-            abAppend(&ab, "*", 1);
+    abInit(ab);
+    if (l->shownok && l->shownoff == (size_t) (buf - l->buf) &&
+        !hintsCallback) {
+        /* The screen holds the prompt followed by shownText: skip the
+         * common prefix and rewrite only the part that changed. */
+        size_t same = 0;
+        size_t col = l->showncol;
+
+        while (same < len && same < l->shownlen &&
+               (maskmode == 1 || buf[same] == shownText[same]))
+            same++;
+        if (same < len || same < l->shownlen) {
+            abMoveCursor(ab, col, plen + same, l->cols);
+            if (maskmode == 1) {
+                size_t n = len - same;
+                while (n--)
+                    abAppend(ab, "*", 1);
+            } else {
+                abAppend(ab, buf + same, len - same);
+            }
+            if (len < l->shownlen)
+                abAppend(ab, "\x1b[0K", 4);
+            col = plen + len;
+        }
+        abMoveCursor(ab, col, plen + pos, l->cols);
     } else {
-        abAppend(&ab, buf, len);
+        /* Cursor to left edge */
+        snprintf(seq, 64, "\r");
+        abAppend(ab, seq, strlen(seq));
+        /* Write the prompt and the current buffer content */
+        abAppend(ab, l->prompt, strlen(l->prompt));
+        if (maskmode == 1) {
+            size_t n = len;
+            while (n--)
+                abAppend(ab, "*", 1);
+        } else {
+            abAppend(ab, buf, len);
+        }
+        /* Show hits if any. */
+        refreshShowHints(ab, l, plen);
+        /* Erase to right */
+        snprintf(seq, 64, "\x1b[0K");
+        abAppend(ab, seq, strlen(seq));
+        /* Move cursor to original position. */
+        snprintf(seq, 64, "\r\x1b[%dC", (int) (pos + plen));
+        abAppend(ab, seq, strlen(seq));
     }
-    /* Show hits if any. */
-    refreshShowHints(&ab, l, plen);
-    /* Erase to right */
-    snprintf(seq, 64, "\x1b[0K");
-    abAppend(&ab, seq, strlen(seq));
-    /* Move cursor to original position. */
-    snprintf(seq, 64, "\r\x1b[%dC", (int) (pos + plen));
-    abAppend(&ab, seq, strlen(seq));
-    if (write(fd, ab.b, ab.len) == -1) {
+    /* Remember what is on screen for the next refresh. */
+    l->shownok = len <= sizeof(shownText);
+    if (l->shownok)
+        memcpy(shownText, buf, len);
+    l->shownlen = len;
+    l->shownoff = buf - l->buf;
+    l->showncol = plen + pos;
+    if (ab->len && write(fd, ab->b, ab->len) == -1) {
     } /* Can't recover from write error. */
-    abFree(&ab);
 }
 
 /* Multi line low level line refresh.
@@ -615,7 +736,7 @@ static void refreshMultiLine(struct linenoiseState *l)
     int col; /* colum position, zero-based. */
     int old_rows = l->maxrows;
     int fd = l->ofd, j;
-    struct abuf ab;
+    struct abuf *ab = &outbuf;
 
     /* Update maxrows if needed. */
     if (rows > (int) l->maxrows)
@@ -623,45 +744,45 @@ static void refreshMultiLine(struct linenoiseState *l)
 
     /* First step: clear all the lines used before. To do so start by
      * going to the last row. */
-    abInit(&ab);
+    abInit(ab);
     if (old_rows - rpos > 0) {
         lndebug("go down %d", old_rows - rpos);
         snprintf(seq, 64, "\x1b[%dB", old_rows - rpos);
-        abAppend(&ab, seq, strlen(seq));
+        abAppend(ab, seq, strlen(seq));
     }
 
     /* Now for every row clear it, go up. */
     for (j = 0; j < old_rows - 1; j++) {
         lndebug("clear+up");
         snprintf(seq, 64, "\r\x1b[0K\x1b[1A");
-        abAppend(&ab, seq, strlen(seq));
+        abAppend(ab, seq, strlen(seq));
     }
 
     /* Clean the top line. */
     lndebug("clear");
     snprintf(seq, 64, "\r\x1b[0K");
-    abAppend(&ab, seq, strlen(seq));
+    abAppend(ab, seq, strlen(seq));
 
     /* Write the prompt and the current buffer content */
-    abAppend(&ab, l->prompt, strlen(l->prompt));
+    abAppend(ab, l->prompt, strlen(l->prompt));
     if (maskmode == 1) {
         unsigned int i;
         for (i = 0; i < l->len; i++)
-            abAppend(&ab, "*", 1);
+            abAppend(ab, "*", 1);
     } else {
-        abAppend(&ab, l->buf, l->len);
+        abAppend(ab, l->buf, l->len);
     }
 
     /* Show hits if any. */
-    refreshShowHints(&ab, l, plen);
+    refreshShowHints(ab, l, plen);
 
     /* If we are at the very end of the screen with our prompt, we need to
      * emit a newline and move the prompt to the first column. */
     if (l->pos && l->pos == l->len && (l->pos + plen) % l->cols == 0) {
         lndebug("<newline>");
-        abAppend(&ab, "\n", 1);
+        abAppend(ab, "\n", 1);
         snprintf(seq, 64, "\r");
-        abAppend(&ab, seq, strlen(seq));
+        abAppend(ab, seq, strlen(seq));
         rows++;
         if (rows > (int) l->maxrows)
             l->maxrows = rows;
@@ -676,7 +797,7 @@ static void refreshMultiLine(struct linenoiseState *l)
     if (rows - rpos2 > 0) {
         lndebug("go-up %d", rows - rpos2);
         snprintf(seq, 64, "\x1b[%dA", rows - rpos2);
-        abAppend(&ab, seq, strlen(seq));
+        abAppend(ab, seq, strlen(seq));
     }
 
     /* Set column. */
@@ -686,14 +807,14 @@ static void refreshMultiLine(struct linenoiseState *l)
         snprintf(seq, 64, "\r\x1b[%dC", col);
     else
         snprintf(seq, 64, "\r");
-    abAppend(&ab, seq, strlen(seq));
+    abAppend(ab, seq, strlen(seq));
 
     lndebug("\n");
     l->oldpos = l->pos;
+    l->shownok = 0;
 
-    if (write(fd, ab.b, ab.len) == -1) {
+    if (write(fd, ab->b, ab->len) == -1) {
     } /* Can't recover from write error. */
-    abFree(&ab);
 }
 
 /* Calls the two low level functions refreshSingleLine() or
@@ -712,28 +833,14 @@ static void refreshLine(struct linenoiseState *l)
 int linenoiseEditInsert(struct linenoiseState *l, char c)
 {
     if (l->len < l->buflen) {
-        if (l->len == l->pos) {
-            l->buf[l->pos] = c;
-            l->pos++;
-            l->len++;
-            l->buf[l->len] = '\0';
-            if ((!mlmode && l->plen + l->len < l->cols && !hintsCallback)) {
-                /* Avoid a full update of the line in the
-                 * trivial case. */
-                char d = (maskmode == 1) ? '*' : c;
-                if (write(l->ofd, &d, 1) == -1)
-                    return -1;
-            } else {
-                refreshLine(l);
-            }
-        } else {
-            memmove(l->buf + l->pos + 1, l->buf + l->pos, l->len - l->pos);
-            l->buf[l->pos] = c;
-            l->len++;
-            l->pos++;
-            l->buf[l->len] = '\0';
-            refreshLine(l);
-        }
+        /* Appending at the end takes no special case: the incremental
+         * refresh writes just the new character. */
+        memmove(l->buf + l->pos + 1, l->buf + l->pos, l->len - l->pos);
+        l->buf[l->pos] = c;
+        l->len++;
+        l->pos++;
+        l->buf[l->len] = '\0';
+        refreshLine(l);
     }
     return 0;
 }
@@ -783,8 +890,9 @@ void linenoiseEditHistoryNext(struct linenoiseState *l, int dir)
     if (history_len > 1) {
         /* Update the current history entry before to
          * overwrite it with the next one. */
-        free(history[history_len - 1 - l->history_index]);
-        history[history_len - 1 - l->history_index] = strdup(l->buf);
+        char **entry = historyAt(history_len - 1 - l->history_index);
+        free(*entry);
+        *entry = strdup(l->buf);
         /* Show the new entry */
         l->history_index += (dir == LINENOISE_HISTORY_PREV) ? 1 : -1;
         if (l->history_index < 0) {
@@ -794,7 +902,8 @@ void linenoiseEditHistoryNext(struct linenoiseState *l, int dir)
             l->history_index = history_len - 1;
             return;
         }
-        strncpy(l->buf, history[history_len - 1 - l->history_index], l->buflen);
+        strncpy(l->buf, *historyAt(history_len - 1 - l->history_index),
+                l->buflen);
         l->buf[l->buflen - 1] = '\0';
         l->len = l->pos = strlen(l->buf);
         refreshLine(l);
@@ -871,6 +980,9 @@ static int linenoiseEdit(int stdin_fd,
     l.cols = getColumns(stdin_fd, stdout_fd);
     l.maxrows = 0;
     l.history_index = 0;
+    l.shownok = 1; /* Only the prompt is on screen once written. */
+    l.shownoff = l.shownlen = 0;
+    l.showncol = l.plen;
 
     /* Buffer starts empty. */
     l.buf[0] = '\0';
@@ -887,192 +999,183 @@ static int linenoiseEdit(int stdin_fd,
         int nread;
         char seq[3];
 
-        fd_set set;
-        FD_ZERO(&set);
-        FD_SET(listenfd, &set);
-        FD_SET(stdin_fd, &set);
-        int rv = select(listenfd + 1, &set, NULL, NULL, NULL);
-        struct sockaddr_in clientaddr;
-        socklen_t clientlen = sizeof clientaddr;
-        int connfd;
-
-        switch (rv) {
-        case -1:
-            perror("select"); /* an error occurred */
-            continue;
-        case 0:
-            printf("timeout occurred\n"); /* a timeout occurred */
-            continue;
-        default:
-            if (listenfd && FD_ISSET(listenfd, &set)) {
-                connfd = accept(listenfd, (SA *) &clientaddr, &clientlen);
-                char *p = process(connfd, &clientaddr);
-                strncpy(buf, p, strlen(p) + 1);
-                close(connfd);
-                free(p);
-                return strlen(p);
-            } else if (FD_ISSET(stdin_fd, &set)) {
-                nread = read(l.ifd, &c, 1);
-                if (nread <= 0)
-                    return l.len;
-
-                /* Only autocomplete when the callback is set. It returns < 0
-                 * when there was an error reading from fd. Otherwise it will
-                 * return the character that should be handled next. */
-                if (c == 9 && completionCallback != NULL) {
-                    c = completeLine(&l);
-                    /* Return on errors */
-                    if (c < 0)
-                        return l.len;
-                    /* Read next character when 0 */
-                    if (c == 0)
-                        continue;
-                }
+        /* Wait for key or web command, unless keys are already buffered */
+        char *cmd = web_recv();
+        if (!cmd && inbufPos == inbufLen) {
+            keyReady = 0;
+            while (!keyReady && !(cmd = web_recv()))
+                event_poll(-1);
+        }
 
-                switch (c) {
-                case ENTER: /* enter */
-                    history_len--;
-                    free(history[history_len]);
-                    if (mlmode)
-                        linenoiseEditMoveEnd(&l);
-                    if (hintsCallback) {
-                        /* Force a refresh without hints to leave the previous
-                         * line as the user typed it after a newline. */
-                        linenoiseHintsCallback *hc = hintsCallback;
-                        hintsCallback = NULL;
-                        refreshLine(&l);
-                        hintsCallback = hc;
-                    }
-                    return (int) l.len;
-                case CTRL_C: /* ctrl-c */
-                    errno = EAGAIN;
-                    return -1;
-                case BACKSPACE: /* backspace */
-                case 8:         /* ctrl-h */
-                    linenoiseEditBackspace(&l);
-                    break;
-                case CTRL_D: /* ctrl-d, remove char at right of cursor, or if
-                                the line is empty, act as end-of-file. */
-                    if (l.len > 0) {
-                        linenoiseEditDelete(&l);
-                    } else {
-                        history_len--;
-                        free(history[history_len]);
-                        return -1;
-                    }
-                    break;
-                case CTRL_T: /* ctrl-t, swaps current character with previous.
-                              */
-                    if (l.pos > 0 && l.pos < l.len) {
-                        int aux = buf[l.pos - 1];
-                        buf[l.pos - 1] = buf[l.pos];
-                        buf[l.pos] = aux;
-                        if (l.pos != l.len - 1)
-                            l.pos++;
-                        refreshLine(&l);
-                    }
-                    break;
-                case CTRL_B: /* ctrl-b */
-                    linenoiseEditMoveLeft(&l);
-                    break;
-                case CTRL_F: /* ctrl-f */
-                    linenoiseEditMoveRight(&l);
-                    break;
-                case CTRL_P: /* ctrl-p */
-                    linenoiseEditHistoryNext(&l, LINENOISE_HISTORY_PREV);
-                    break;
-                case CTRL_N: /* ctrl-n */
-                    linenoiseEditHistoryNext(&l, LINENOISE_HISTORY_NEXT);
-                    break;
-                case ESC: /* escape sequence */
-                    /* Read the next two bytes representing the escape sequence.
-                     * Use two calls to handle slow terminals returning the two
-                     * chars at different times. */
-                    if (read(l.ifd, seq, 1) == -1)
-                        break;
-                    if (read(l.ifd, seq + 1, 1) == -1)
-                        break;
+        if (cmd) {
+            size_t len = strlen(cmd);
+            if (len > l.buflen)
+                len = l.buflen;
+            memcpy(buf, cmd, len);
+            buf[len] = '\0';
+            free(cmd);
+            return len;
+        }
 
-                    /* ESC [ sequences. */
-                    if (seq[0] == '[') {
-                        if (seq[1] >= '0' && seq[1] <= '9') {
-                            /* Extended escape, read additional byte. */
-                            if (read(l.ifd, seq + 2, 1) == -1)
-                                break;
-                            if (seq[2] == '~') {
-                                switch (seq[1]) {
-                                case '3': /* Delete key. */
-                                    linenoiseEditDelete(&l);
-                                    break;
-                                }
-                            }
-                        } else {
-                            switch (seq[1]) {
-                            case 'A': /* Up */
-                                linenoiseEditHistoryNext(
-                                    &l, LINENOISE_HISTORY_PREV);
-                                break;
-                            case 'B': /* Down */
-                                linenoiseEditHistoryNext(
-                                    &l, LINENOISE_HISTORY_NEXT);
-                                break;
-                            case 'C': /* Right */
-                                linenoiseEditMoveRight(&l);
-                                break;
-                            case 'D': /* Left */
-                                linenoiseEditMoveLeft(&l);
-                                break;
-                            case 'H': /* Home */
-                                linenoiseEditMoveHome(&l);
-                                break;
-                            case 'F': /* End*/
-                                linenoiseEditMoveEnd(&l);
-                                break;
-                            }
-                        }
-                    }
+        nread = readByte(l.ifd, (char *) &c);
+        if (nread <= 0)
+            return l.len;
+
+        /* Only autocomplete when the callback is set. It returns < 0
+         * when there was an error reading from fd. Otherwise it will
+         * return the character that should be handled next. */
+        if (c == 9 && completionCallback != NULL) {
+            c = completeLine(&l);
+            /* Return on errors */
+            if (c < 0)
+                return l.len;
+            /* Read next character when 0 */
+            if (c == 0)
+                continue;
+        }
+
+        switch (c) {
+        case ENTER: /* enter */
+            history_len--;
+            free(*historyAt(history_len));
+            if (mlmode)
+                linenoiseEditMoveEnd(&l);
+            if (hintsCallback) {
+                /* Force a refresh without hints to leave the previous
+                 * line as the user typed it after a newline. */
+                linenoiseHintsCallback *hc = hintsCallback;
+                hintsCallback = NULL;
+                /* The hint is on screen, so no update can build on it */
+                l.shownok = 0;
+                refreshLine(&l);
+                hintsCallback = hc;
+            }
+            return (int) l.len;
+        case CTRL_C: /* ctrl-c */
+            errno = EAGAIN;
+            return -1;
+        case BACKSPACE: /* backspace */
+        case 8:         /* ctrl-h */
+            linenoiseEditBackspace(&l);
+            break;
+        case CTRL_D: /* ctrl-d, remove char at right of cursor, or if the
+                        line is empty, act as end-of-file. */
+            if (l.len > 0) {
+                linenoiseEditDelete(&l);
+            } else {
+                history_len--;
+                free(*historyAt(history_len));
+                return -1;
+            }
+            break;
+        case CTRL_T: /* ctrl-t, swaps current character with previous. */
+            if (l.pos > 0 && l.pos < l.len) {
+                int aux = buf[l.pos - 1];
+                buf[l.pos - 1] = buf[l.pos];
+                buf[l.pos] = aux;
+                if (l.pos != l.len - 1)
+                    l.pos++;
+                refreshLine(&l);
+            }
+            break;
+        case CTRL_B: /* ctrl-b */
+            linenoiseEditMoveLeft(&l);
+            break;
+        case CTRL_F: /* ctrl-f */
+            linenoiseEditMoveRight(&l);
+            break;
+        case CTRL_P: /* ctrl-p */
+            linenoiseEditHistoryNext(&l, LINENOISE_HISTORY_PREV);
+            break;
+        case CTRL_N: /* ctrl-n */
+            linenoiseEditHistoryNext(&l, LINENOISE_HISTORY_NEXT);
+            break;
+        case ESC: /* escape sequence */
+            /* Read the next two bytes representing the escape sequence.
+             * Use two calls to handle slow terminals returning the two
+             * chars at different times. */
+            if (readByte(l.ifd, seq) == -1)
+                break;
+            if (readByte(l.ifd, seq + 1) == -1)
+                break;
 
-                    /* ESC O sequences. */
-                    else if (seq[0] == 'O') {
+            /* ESC [ sequences. */
+            if (seq[0] == '[') {
+                if (seq[1] >= '0' && seq[1] <= '9') {
+                    /* Extended escape, read additional byte. */
+                    if (readByte(l.ifd, seq + 2) == -1)
+                        break;
+                    if (seq[2] == '~') {
                         switch (seq[1]) {
-                        case 'H': /* Home */
-                            linenoiseEditMoveHome(&l);
-                            break;
-                        case 'F': /* End*/
-                            linenoiseEditMoveEnd(&l);
+                        case '3': /* Delete key. */
+                            linenoiseEditDelete(&l);
                             break;
                         }
                     }
-                    break;
-                default:
-                    if (linenoiseEditInsert(&l, c))
-                        return -1;
-                    break;
-                case CTRL_U: /* Ctrl+u, delete the whole line. */
-                    buf[0] = '\0';
-                    l.pos = l.len = 0;
-                    refreshLine(&l);
-                    break;
-                case CTRL_K: /* Ctrl+k, delete from current to end of line. */
-                    buf[l.pos] = '\0';
-                    l.len = l.pos;
-                    refreshLine(&l);
-                    break;
-                case CTRL_A: /* Ctrl+a, go to the start of the line */
+                } else {
+                    switch (seq[1]) {
+                    case 'A': /* Up */
+                        linenoiseEditHistoryNext(&l, LINENOISE_HISTORY_PREV);
+                        break;
+                    case 'B': /* Down */
+                        linenoiseEditHistoryNext(&l, LINENOISE_HISTORY_NEXT);
+                        break;
+                    case 'C': /* Right */
+                        linenoiseEditMoveRight(&l);
+                        break;
+                    case 'D': /* Left */
+                        linenoiseEditMoveLeft(&l);
+                        break;
+                    case 'H': /* Home */
+                        linenoiseEditMoveHome(&l);
+                        break;
+                    case 'F': /* End*/
+                        linenoiseEditMoveEnd(&l);
+                        break;
+                    }
+                }
+            }
+
+            /* ESC O sequences. */
+            else if (seq[0] == 'O') {
+                switch (seq[1]) {
+                case 'H': /* Home */
                     linenoiseEditMoveHome(&l);
                     break;
-                case CTRL_E: /* ctrl+e, go to the end of the line */
+                case 'F': /* End*/
                     linenoiseEditMoveEnd(&l);
                     break;
-                case CTRL_L: /* ctrl+l, clear screen */
-                    linenoiseClearScreen();
-                    refreshLine(&l);
-                    break;
-                case CTRL_W: /* ctrl+w, delete previous word */
-                    linenoiseEditDeletePrevWord(&l);
-                    break;
                 }
             }
+            break;
+        default:
+            if (linenoiseEditInsert(&l, c))
+                return -1;
+            break;
+        case CTRL_U: /* Ctrl+u, delete the whole line. */
+            buf[0] = '\0';
+            l.pos = l.len = 0;
+            refreshLine(&l);
+            break;
+        case CTRL_K: /* Ctrl+k, delete from current to end of line. */
+            buf[l.pos] = '\0';
+            l.len = l.pos;
+            refreshLine(&l);
+            break;
+        case CTRL_A: /* Ctrl+a, go to the start of the line */
+            linenoiseEditMoveHome(&l);
+            break;
+        case CTRL_E: /* ctrl+e, go to the end of the line */
+            linenoiseEditMoveEnd(&l);
+            break;
+        case CTRL_L: /* ctrl+l, clear screen */
+            linenoiseClearScreen();
+            l.shownok = 0;
+            refreshLine(&l);
+            break;
+        case CTRL_W: /* ctrl+w, delete previous word */
+            linenoiseEditDeletePrevWord(&l);
+            break;
         }
     }
     return l.len;
@@ -1124,7 +1227,10 @@ static int linenoiseRaw(char *buf, size_t buflen, const char *prompt)
 
     if (enableRawMode(STDIN_FILENO) == -1)
         return -1;
+    /* Web commands are taken while waiting for keys. */
+    event_add(STDIN_FILENO, inputReady, &keyReady);
     count = linenoiseEdit(STDIN_FILENO, STDOUT_FILENO, buf, buflen, prompt);
+    event_del(STDIN_FILENO);
     disableRawMode(STDIN_FILENO);
     printf("\n");
     return count;
@@ -1215,6 +1321,14 @@ void linenoiseFree(void *ptr)
 
 /* ================================ History ================================= */
 
+/* The history is a ring buffer of history_max_len entries, holding
+ * history_len of them starting at history_start.  Return the slot of
+ * the i-th oldest entry. */
+static char **historyAt(int i)
+{
+    return &history[(history_start + i) % history_max_len];
+}
+
 /* Free the history, but does not reset it. Only used when we have to
  * exit() to avoid memory leaks are reported by valgrind & co. */
 static void freeHistory(void)
@@ -1223,9 +1337,12 @@ static void freeHistory(void)
         int j;
 
         for (j = 0; j < history_len; j++)
-            free(history[j]);
+            free(*historyAt(j));
         free(history);
     }
+    if (journal_fd != -1)
+        close(journal_fd);
+    free(journal_name);
 }
 
 /* At exit we'll try to fix the terminal to the initial conditions. */
@@ -1233,15 +1350,13 @@ static void linenoiseAtExit(void)
 {
     disableRawMode(STDIN_FILENO);
     freeHistory();
+    abFree(&outbuf);
 }
 
 /* This is the API call to add a new entry in the linenoise history.
- * It uses a fixed array of char pointers that are shifted (memmoved)
- * when the history max length is reached in order to remove the older
- * entry and make room for the new one, so it is not exactly suitable for huge
- * histories, but will work well for a few hundred of entries.
- *
- * Using a circular buffer is smarter, but a bit more complex to handle. */
+ * When the history max length is reached the oldest entry is dropped
+ * from the ring buffer to make room for the new one.
+ * Returns 1 if the line was added, 0 otherwise. */
 int linenoiseHistoryAdd(const char *line)
 {
     char *linecopy;
@@ -1255,10 +1370,11 @@ int linenoiseHistoryAdd(const char *line)
         if (history == NULL)
             return 0;
         memset(history, 0, (sizeof(char *) * history_max_len));
+        history_start = 0;
     }
 
     /* Don't add duplicated lines. */
-    if (history_len && !strcmp(history[history_len - 1], line))
+    if (history_len && !strcmp(*historyAt(history_len - 1), line))
         return 0;
 
     /* Add an heap allocated copy of the line in the history.
@@ -1267,11 +1383,11 @@ int linenoiseHistoryAdd(const char *line)
     if (!linecopy)
         return 0;
     if (history_len == history_max_len) {
-        free(history[0]);
-        memmove(history, history + 1, sizeof(char *) * (history_max_len - 1));
+        free(*historyAt(0));
+        history_start = (history_start + 1) % history_max_len;
         history_len--;
     }
-    history[history_len] = linecopy;
+    *historyAt(history_len) = linecopy;
     history_len++;
     return 1;
 }
@@ -1288,6 +1404,7 @@ int linenoiseHistorySetMaxLen(int len)
         return 0;
     if (history) {
         int tocopy = history_len;
+        int j;
 
         new = malloc(sizeof(char *) * len);
         if (new == NULL)
@@ -1295,16 +1412,16 @@ int linenoiseHistorySetMaxLen(int len)
 
         /* If we can't copy everything, free the elements we'll not use. */
         if (len < tocopy) {
-            int j;
-
             for (j = 0; j < tocopy - len; j++)
-                free(history[j]);
+                free(*historyAt(j));
             tocopy = len;
         }
         memset(new, 0, sizeof(char *) * len);
-        memcpy(new, history + (history_len - tocopy), sizeof(char *) * tocopy);
+        for (j = 0; j < tocopy; j++)
+            new[j] = *historyAt(history_len - tocopy + j);
         free(history);
         history = new;
+        history_start = 0;
     }
     history_max_len = len;
     if (history_len > history_max_len)
@@ -1326,8 +1443,52 @@ int linenoiseHistorySave(const char *filename)
         return -1;
     chmod(filename, S_IRUSR | S_IWUSR);
     for (j = 0; j < history_len; j++)
-        fprintf(fp, "%s\n", history[j]);
+        fprintf(fp, "%s\n", *historyAt(j));
     fclose(fp);
+    if (journal_name && !strcmp(filename, journal_name))
+        journal_lines = history_len;
+    return 0;
+}
+
+/* Add a line to the history and append it to the journal file 'filename',
+ * so that saving it costs one write instead of rewriting the file.  Once
+ * the file holds twice as many lines as the history can, it is compacted
+ * by rewriting it with just the history.  On success 0 is returned
+ * otherwise -1 is returned. */
+int linenoiseHistoryAppend(const char *filename, const char *line)
+{
+    if (!linenoiseHistoryAdd(line))
+        return 0;
+
+    if (!journal_name || strcmp(filename, journal_name)) {
+        if (journal_fd != -1)
+            close(journal_fd);
+        free(journal_name);
+        journal_name = strdup(filename);
+        journal_fd = -1;
+        journal_lines = 0;
+        if (!journal_name)
+            return -1;
+    }
+
+    if (journal_fd == -1) {
+        /* Start from the history alone, also dropping any partial line. */
+        if (linenoiseHistorySave(filename) == -1)
+            return -1;
+        journal_fd = open(filename, O_WRONLY | O_APPEND | O_CLOEXEC);
+        return journal_fd == -1 ? -1 : 0;
+    }
+
+    if (journal_lines >= 2 * history_max_len)
+        return linenoiseHistorySave(filename);
+
+    struct iovec iov[2] = {
+        {.iov_base = (void *) line, .iov_len = strlen(line)},
+        {.iov_base = "\n", .iov_len = 1},
+    };
+    if (writev(journal_fd, iov, 2) == -1)
+        return -1;
+    journal_lines++;
     return 0;
 }
 
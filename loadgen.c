@@ -0,0 +1,481 @@
+/*
+ * Load generator for the web interface of qtest.
+ *
+ * Replays the commands of a trace file as HTTP requests over several
+ * keep-alive connections, optionally at a fixed rate, and reports
+ * throughput and latency percentiles.  Latency counts from when a request
+ * is sent, and how late requests go at a fixed rate is reported apart.
+ * Each connection has one request outstanding at a time; commands are
+ * handed out in trace order to whichever connection is idle, so a single
+ * connection replays the trace exactly as written.
+ */
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h> /* strncasecmp */
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "tiny.h"
+
+#define MAXCONNS 1024    /* max number of connections */
+#define RESP_BUFSIZE 4096 /* initial size of a response buffer */
+
+/* Request for one command of the trace, sent as POST body */
+typedef struct {
+    char *data;
+    size_t len;
+} request_t;
+
+typedef struct {
+    int fd; /* -1 when not connected */
+    const request_t *req;
+    size_t sent;   /* bytes of req already sent */
+    double start;  /* when request was sent, latency counts from there */
+    char *buf;     /* response received so far */
+    size_t len;    /* bytes in buf */
+    size_t cap;    /* size of buf */
+    size_t need;   /* length of whole response, 0 until head is read */
+    int status;    /* status of response */
+    bool busy;     /* request outstanding */
+} conn_t;
+
+static const char *host = "127.0.0.1";
+static int port = DEFAULT_PORT;
+static struct sockaddr_in server;
+
+static request_t *requests = NULL;
+static size_t nrequests = 0;
+
+static conn_t conns[MAXCONNS];
+static int nconns = 8;
+static int idle[MAXCONNS]; /* stack of idle connections */
+static int nidle = 0;
+
+static double *latency = NULL; /* of each completed request, in seconds */
+static size_t completed = 0;
+static size_t failed = 0;     /* responses with status other than 2xx */
+static size_t conn_errors = 0; /* connections lost while busy */
+
+/* How much later than due requests were sent, when sent at a fixed rate */
+static size_t started = 0;
+static double late_sum = 0;
+static double late_max = 0;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void usage(char *cmd)
+{
+    printf(
+        "Usage: %s [-h] [-H HOST][-p PORT][-c CONNS][-r RATE][-n COUNT]"
+        " TRACE\n",
+        cmd);
+    printf("\t-h         Print this information\n");
+    printf("\t-H HOST    Connect to HOST (default %s)\n", host);
+    printf("\t-p PORT    Connect to PORT (default %d)\n", DEFAULT_PORT);
+    printf("\t-c CONNS   Use CONNS connections (default %d)\n", nconns);
+    printf("\t-r RATE    Send RATE requests per second (default unlimited)\n");
+    printf("\t-n COUNT   Replay trace COUNT times (default 1)\n");
+    exit(0);
+}
+
+/* Request sending a command of the trace as its body */
+#define REQUEST_FMT               \
+    "POST / HTTP/1.1\r\n"         \
+    "Host: %s:%d\r\n"             \
+    "Content-Length: %zu\r\n\r\n" \
+    "%.*s\n"
+
+/* Read commands of trace file, leaving out comments and quit */
+static bool load_trace(const char *fname)
+{
+    FILE *f = fopen(fname, "r");
+    if (!f) {
+        perror(fname);
+        return false;
+    }
+
+    /* Lines of any length are read whole */
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    size_t cap = 0;
+    bool ok = true;
+    while (ok && (linelen = getline(&line, &linecap, f)) >= 0) {
+        char *cmd = line;
+        while (isspace((unsigned char) *cmd))
+            cmd++;
+        size_t len = line + linelen - cmd;
+        while (len && isspace((unsigned char) cmd[len - 1]))
+            len--;
+        /* Quitting would stop the server for everybody */
+        if (!len || cmd[0] == '#' ||
+            (len >= 4 && !strncmp(cmd, "quit", 4) &&
+             (len == 4 || isspace((unsigned char) cmd[4]))))
+            continue;
+
+        if (nrequests == cap) {
+            cap = cap ? cap * 2 : 64;
+            request_t *r = realloc(requests, cap * sizeof(request_t));
+            if (!r) {
+                ok = false;
+                break;
+            }
+            requests = r;
+        }
+        request_t *r = &requests[nrequests];
+        size_t size = snprintf(NULL, 0, REQUEST_FMT, host, port, len + 1,
+                               (int) len, cmd) +
+                      1;
+        r->data = malloc(size);
+        if (!r->data) {
+            ok = false;
+            break;
+        }
+        r->len = snprintf(r->data, size, REQUEST_FMT, host, port, len + 1,
+                          (int) len, cmd);
+        nrequests++;
+    }
+    free(line);
+    if (ok && ferror(f)) {
+        perror(fname);
+        fclose(f);
+        return false;
+    }
+    fclose(f);
+    if (!ok)
+        fprintf(stderr, "Out of memory reading %s\n", fname);
+    return ok;
+}
+
+static void conn_ready(int fd, void *data);
+
+static bool open_conn(conn_t *c)
+{
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0) {
+        perror("socket");
+        return false;
+    }
+    if (connect(c->fd, (struct sockaddr *) &server, sizeof(server)) < 0) {
+        perror("connect");
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+    /* Requests are small and each waits for its response */
+    int on = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fcntl(c->fd, F_SETFL, O_NONBLOCK);
+    if (!event_add(c->fd, conn_ready, c)) {
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+    return true;
+}
+
+static void close_conn(conn_t *c)
+{
+    event_del(c->fd);
+    close(c->fd);
+    c->fd = -1;
+}
+
+/* Send what is left of the request, watching for room if it does not fit */
+static bool send_request(conn_t *c)
+{
+    while (c->sent < c->req->len) {
+        ssize_t n =
+            send(c->fd, c->req->data + c->sent, c->req->len - c->sent,
+                 MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                return false;
+            event_set(c->fd, true, true);
+            return true;
+        }
+        c->sent += n;
+    }
+    event_set(c->fd, true, false);
+    return true;
+}
+
+/* Account for the response to the request of c, or for its failure */
+static void finish_request(conn_t *c, bool ok)
+{
+    if (ok) {
+        latency[completed++] = now() - c->start;
+        if (c->status < 200 || c->status > 299)
+            failed++;
+    } else {
+        conn_errors++;
+        close_conn(c);
+    }
+    c->busy = false;
+    c->len = c->need = 0;
+    idle[nidle++] = c - conns;
+}
+
+/* Find length of the response in c->buf once its head is complete */
+static bool parse_head(conn_t *c)
+{
+    char *end = NULL;
+    for (size_t i = 0; i + 4 <= c->len && !end; i++) {
+        if (!memcmp(c->buf + i, "\r\n\r\n", 4))
+            end = c->buf + i;
+    }
+    if (!end)
+        return false;
+    size_t head_len = end + 4 - c->buf;
+    *end = '\0';
+    c->status = 0;
+    sscanf(c->buf, "HTTP/%*s %d", &c->status);
+
+    size_t body_len = 0;
+    const char *name = "\r\nContent-Length:";
+    for (char *p = c->buf; (p = strstr(p, "\r\n")); p += 2) {
+        if (!strncasecmp(p, name, strlen(name))) {
+            body_len = strtoul(p + strlen(name), NULL, 10);
+            break;
+        }
+    }
+    c->need = head_len + body_len;
+    return true;
+}
+
+static void conn_ready(int fd, void *data)
+{
+    conn_t *c = data;
+
+    /* Nothing is expected while idle, so the server closed or misbehaved */
+    if (!c->busy) {
+        close_conn(c);
+        return;
+    }
+    if (c->sent < c->req->len && !send_request(c)) {
+        finish_request(c, false);
+        return;
+    }
+
+    while (c->busy) {
+        if (c->len == c->cap) {
+            size_t cap = c->cap ? c->cap * 2 : RESP_BUFSIZE;
+            char *buf = realloc(c->buf, cap);
+            if (!buf) {
+                finish_request(c, false);
+                return;
+            }
+            c->buf = buf;
+            c->cap = cap;
+        }
+        ssize_t n = recv(fd, c->buf + c->len, c->cap - c->len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return;
+        if (n <= 0) {
+            finish_request(c, false);
+            return;
+        }
+        c->len += n;
+        if (!c->need && !parse_head(c))
+            continue;
+        if (c->len >= c->need)
+            finish_request(c, true);
+    }
+}
+
+/* Start request i on an idle connection, connecting it first if need be */
+static bool start_request(size_t i, double due)
+{
+    conn_t *c = &conns[idle[--nidle]];
+    if (c->fd < 0 && !open_conn(c)) {
+        idle[nidle++] = c - conns;
+        return false;
+    }
+    c->req = &requests[i % nrequests];
+    c->sent = 0;
+    c->start = now();
+    c->busy = true;
+    double late = c->start - due;
+    started++;
+    late_sum += late;
+    if (late > late_max)
+        late_max = late;
+    if (!send_request(c))
+        finish_request(c, false);
+    return true;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Latency at percentile p of the sorted latencies, in milliseconds */
+static double percentile(double p)
+{
+    size_t i = (size_t) ceil(p / 100 * completed);
+    return latency[i ? i - 1 : 0] * 1e3;
+}
+
+static void report_results(double elapsed, bool paced)
+{
+    printf("%zu requests in %.3f s over %d connections: %.0f requests/s\n",
+           completed, elapsed, nconns, completed / elapsed);
+    printf("%zu failed, %zu connection errors\n", failed, conn_errors);
+    if (!completed)
+        return;
+    qsort(latency, completed, sizeof(double), compare_double);
+    double sum = 0;
+    for (size_t i = 0; i < completed; i++)
+        sum += latency[i];
+    printf("Latency (ms): mean %.3f\n", sum / completed * 1e3);
+    printf("\tp50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+           percentile(50), percentile(90), percentile(99), percentile(99.9),
+           latency[completed - 1] * 1e3);
+    if (paced)
+        printf("Sent late (ms): mean %.3f  max %.3f\n",
+               late_sum / started * 1e3, late_max * 1e3);
+}
+
+static void sigint_handler(int sig)
+{
+    interrupted = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    double rate = 0;
+    long count = 1;
+    int c;
+
+    while ((c = getopt(argc, argv, "hH:p:c:r:n:")) != -1) {
+        switch (c) {
+        case 'h':
+            usage(argv[0]);
+            break;
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            if (nconns < 1 || nconns > MAXCONNS) {
+                fprintf(stderr, "Connections must be from 1 to %d\n",
+                        MAXCONNS);
+                return 1;
+            }
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'n':
+            count = atol(optarg);
+            break;
+        default:
+            printf("Unknown option '%c'\n", c);
+            usage(argv[0]);
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *ai;
+    if (getaddrinfo(host, NULL, &hints, &ai)) {
+        fprintf(stderr, "Unknown host %s\n", host);
+        return 1;
+    }
+    server = *(struct sockaddr_in *) ai->ai_addr;
+    server.sin_port = htons(port);
+    freeaddrinfo(ai);
+
+    if (!load_trace(argv[optind]))
+        return 1;
+    if (!nrequests || count < 1) {
+        fprintf(stderr, "No commands to send\n");
+        return 1;
+    }
+    size_t total = nrequests * count;
+    latency = malloc(total * sizeof(double));
+    if (!latency) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (int i = 0; i < nconns; i++) {
+        conns[i].fd = -1;
+        idle[nidle++] = nconns - 1 - i;
+    }
+    signal(SIGINT, sigint_handler);
+
+    size_t issued = 0;
+    double start = now();
+    while (completed + conn_errors < total && !interrupted) {
+        double t = now();
+        int timeout = -1;
+        while (issued < total && nidle) {
+            /* Requests are due at fixed intervals, however late they go */
+            double due = rate > 0 ? start + issued / rate : t;
+            if (due > t) {
+                /*
+                 * Sleep whole milliseconds only, and poll without waiting
+                 * through the rest, not to send late by the poll overshoot
+                 */
+                timeout = (int) ((due - t) * 1e3);
+                break;
+            }
+            if (!start_request(issued, due)) {
+                interrupted = 1;
+                break;
+            }
+            issued++;
+        }
+        if (nidle == nconns && issued == total)
+            break;
+        if (!interrupted)
+            event_poll(timeout);
+    }
+    report_results(now() - start, rate > 0);
+
+    for (int i = 0; i < nconns; i++) {
+        if (conns[i].fd >= 0)
+            close_conn(&conns[i]);
+        free(conns[i].buf);
+    }
+    for (size_t i = 0; i < nrequests; i++)
+        free(requests[i].data);
+    free(requests);
+    free(latency);
+    return conn_errors ? 2 : 0;
+}
@@ -15,6 +15,7 @@
 #include "dudect/fixture.h"
 #include "list.h"
 #include "list_sort.h"
+#include "random.h"
 
 /* Our program needs to use regular malloc/free */
 #define INTERNAL 1
@@ -71,10 +72,16 @@ static int fail_count = 0;
 
 static int string_length = MAXSTRING;
 
+/* Seed of random generator, settable to make runs reproducible */
+static int seed = 0;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
 
+/* Queue display and checks after each command deferred to end of batch */
+static bool batch_mode = false;
+
 /* Forward declarations */
 static bool show_queue(int vlevel);
 
@@ -145,10 +152,10 @@ static void fill_rand_string(char *buf, size_t buf_size)
 {
     size_t len = 0;
     while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
+        len = prng_next() % buf_size;
 
     for (size_t n = 0; n < len; n++) {
-        buf[n] = charset[rand() % (sizeof charset - 1)];
+        buf[n] = charset[prng_next() % (sizeof charset - 1)];
     }
     buf[len] = '\0';
 }
@@ -727,13 +734,11 @@ void q_shuffle(struct list_head *head)
     if (!head || list_empty(head))
         return;
 
-    srand(time(NULL));
-
     int size = q_size(head);
     struct list_head *ptr = head->prev;
     element_t *target, *last;
     for (int i = size - 1; i >= 1; i--, ptr = ptr->prev) {
-        int idx = rand() % (i + 1);  // random index in range [0, i]
+        int idx = prng_next() % (i + 1);  // random index in range [0, i]
         last = container_of(ptr, element_t, list);
         target = container_of(get_node(head, idx), element_t, list);
         char *tmp = last->value;
@@ -812,10 +817,34 @@ static bool is_circular()
     return true;
 }
 
+/* Check that queue is doubly circular and has no more than lcnt elements */
+static bool check_queue()
+{
+    if (!l_meta.l)
+        return true;
+
+    if (!is_circular()) {
+        report(1, "ERROR:  Queue is not doubly circular");
+        return false;
+    }
+
+    size_t cnt = 0;
+    struct list_head *cur = l_meta.l->next;
+    while (cur != l_meta.l && cnt <= lcnt) {
+        cnt++;
+        cur = cur->next;
+    }
+    if (cnt > lcnt) {
+        report(1, "ERROR:  Queue has more than %zu elements", lcnt);
+        return false;
+    }
+    return true;
+}
+
 static bool show_queue(int vlevel)
 {
     bool ok = true;
-    if (verblevel < vlevel)
+    if (verblevel < vlevel || (batch_mode && vlevel > 0))
         return true;
 
     int cnt = 0;
@@ -874,6 +903,67 @@ static bool do_show(int argc, char *argv[])
     return show_queue(0);
 }
 
+static bool do_batch(int argc, char *argv[])
+{
+    bool begin = argc == 2 && !strcmp(argv[1], "begin");
+    if (argc != 2 || (!begin && strcmp(argv[1], "end"))) {
+        report(1, "%s needs 1 argument: begin or end", argv[0]);
+        return false;
+    }
+    if (begin == batch_mode) {
+        report(1, "Batch has %s", begin ? "already begun" : "not begun");
+        return false;
+    }
+
+    batch_mode = begin;
+    if (begin)
+        return true;
+    return check_queue() && show_queue(3);
+}
+
+static bool do_memstat(int argc, char *argv[])
+{
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset"))) {
+        report(1, "%s takes at most 1 argument 'reset'", argv[0]);
+        return false;
+    }
+
+    if (argc == 2) {
+        memstat_reset();
+        return true;
+    }
+
+    size_t current, peak;
+    memstat_report(1, NULL);
+    mem_usage(&current, &peak);
+    report(1, "Console bytes = %lu, Peak console bytes = %lu", current, peak);
+    return true;
+}
+
+/* Report allocations made by command run under "time" */
+static void memstat_time(bool done)
+{
+    static memstat_t base;
+    if (!done)
+        memstat_get(&base);
+    else
+        memstat_report(1, &base);
+}
+
+/* Add queue and allocation state to web statistics */
+static void queue_stats(FILE *out)
+{
+    size_t current, peak;
+    mem_usage(&current, &peak);
+    fprintf(out,
+            ",\"queue\":{\"exists\":%s,\"size\":%zu}"
+            ",\"memory\":{\"allocated_count\":%zu,"
+            "\"current_bytes\":%zu,\"peak_bytes\":%zu},",
+            l_meta.l ? "true" : "false", lcnt, allocation_check(), current,
+            peak);
+    cmd_stats_json(out);
+}
+
 static bool do_web(int argc, char *argv[])
 {
     if (!listenfd) {
@@ -884,6 +974,11 @@ static bool do_web(int argc, char *argv[])
     return true;
 }
 
+static void set_seed(int oldval)
+{
+    prng_seed((unsigned int) seed);
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "                | Create new queue");
@@ -921,12 +1016,28 @@ static void console_init()
                 "                | Swap every two adjacent nodes in queue");
     ADD_COMMAND(shuffle, "                | Shuffle the queue");
     ADD_COMMAND(web, "                | web");
+    ADD_COMMAND(batch,
+                " begin|end      | Defer queue checks to end of batch of "
+                "commands");
+    ADD_COMMAND(memstat,
+                " [reset]        | Show or reset allocation statistics of "
+                "queue code");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("malloc_nth", &fail_nth,
+              "Fail every n-th malloc call (0 = never)", NULL);
+    add_param("seed", &seed, "Seed of random generator", set_seed);
+    add_param("timelimit_ms", &time_limit_ms,
+              "Time limit of each queue operation in milliseconds (0 = none)",
+              NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("guard", &guard_mode,
+              "Place allocations against guard pages to trap overruns", NULL);
+    add_param("webfiles", &web_files,
+              "Serve files of current directory under /file/ (0/1)", NULL);
 }
 
 /* Signal handlers */
@@ -941,6 +1052,8 @@ static void sigsegvhandler(int sig)
 
 static void sigalrmhandler(int sig)
 {
+    if (!watchdog_tick())
+        return;
     trigger_exception(
         "Time limit exceeded.  Either you are in an infinite loop, or your "
         "code is too inefficient");
@@ -954,8 +1067,37 @@ static void queue_init()
     signal(SIGALRM, sigalrmhandler);
 }
 
+/* Queue state of each session in server mode */
+typedef struct {
+    list_head_meta_t l_meta;
+    size_t lcnt;
+    int fail_count;
+    bool batch_mode;
+    size_t allocated; /* Blocks allocated by queue code */
+} queue_state_t;
+
+/* Exchange queue state with that of a session */
+static void queue_swap(void *state)
+{
+    queue_state_t *s = state;
+    queue_state_t cur = {l_meta, lcnt, fail_count, batch_mode, s->allocated};
+    l_meta = s->l_meta;
+    lcnt = s->lcnt;
+    fail_count = s->fail_count;
+    batch_mode = s->batch_mode;
+    swap_allocation_count(&cur.allocated);
+    *s = cur;
+}
+
 static bool queue_quit(int argc, char *argv[])
 {
+    bool ok = true;
+    if (batch_mode) {
+        report(1, "Batch not ended, checking queue");
+        char *end_argv[] = {"batch", "end"};
+        ok = do_batch(2, end_argv);
+    }
+
     report(3, "Freeing queue");
     if (lcnt > big_list_size)
         set_cautious_mode(false);
@@ -972,14 +1114,21 @@ static bool queue_quit(int argc, char *argv[])
         return false;
     }
 
-    return true;
+    return ok;
 }
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf(
+        "Usage: %s [-h] [-f IFILE][-F CFILE][-s SOCKET][-w WORKERS]"
+        "[-v VLEVEL][-l LFILE]\n",
+        cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
+    printf("\t-F CFILE   Replay commands compiled into CFILE\n");
+    printf("\t-s SOCKET  Serve sessions connecting to UNIX socket SOCKET\n");
+    printf("\t-w WORKERS Serve web requests on port %d with WORKERS processes\n",
+           DEFAULT_PORT);
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
     exit(0);
@@ -1028,12 +1177,17 @@ int main(int argc, char *argv[])
     /* To hold input file name */
     char buf[BUFSIZE];
     char *infile_name = NULL;
+    char cbuf[BUFSIZE];
+    char *cfile_name = NULL;
+    char sbuf[BUFSIZE];
+    char *sock_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    int workers = 0;
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:F:s:w:l:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -1043,6 +1197,26 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             infile_name = buf;
             break;
+        case 'F':
+            strncpy(cbuf, optarg, BUFSIZE);
+            cbuf[BUFSIZE - 1] = '\0';
+            cfile_name = cbuf;
+            break;
+        case 's':
+            strncpy(sbuf, optarg, BUFSIZE);
+            sbuf[BUFSIZE - 1] = '\0';
+            sock_name = sbuf;
+            break;
+        case 'w': {
+            char *endptr;
+            errno = 0;
+            workers = strtol(optarg, &endptr, 10);
+            if (errno != 0 || endptr == optarg || workers < 1) {
+                fprintf(stderr, "Invalid number of workers\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
         case 'v': {
             char *endptr;
             errno = 0;
@@ -1065,13 +1239,14 @@ int main(int argc, char *argv[])
         }
     }
 
-    srand((unsigned int) (time(NULL)));
+    seed = (int) time(NULL);
+    prng_seed((unsigned int) seed);
     queue_init();
     init_cmd();
     console_init();
 
-    /* Initialize linenoise only when infile_name not exist */
-    if (!infile_name) {
+    /* Initialize linenoise only when reading commands from terminal */
+    if (!infile_name && !cfile_name && !sock_name && !workers) {
         /* Trigger call back function(auto completion) */
         linenoiseSetCompletionCallback(completion);
 
@@ -1087,9 +1262,19 @@ int main(int argc, char *argv[])
         set_logfile(logfile_name);
 
     add_quit_helper(queue_quit);
+    set_time_helper(memstat_time);
+    set_stats_helper(queue_stats);
+    set_session_helper(queue_swap, sizeof(queue_state_t));
 
     bool ok = true;
-    ok = ok && run_console(infile_name);
+    if (cfile_name)
+        ok = ok && run_compiled(cfile_name);
+    else if (sock_name)
+        ok = ok && run_server(sock_name);
+    else if (workers)
+        ok = ok && run_web(workers, DEFAULT_PORT);
+    else
+        ok = ok && run_console(infile_name);
 
     /* Do finish_cmd() before check whether ok is true or false */
     ok = finish_cmd() && ok;
@@ -37,3 +37,26 @@ void randombytes(uint8_t *x, size_t how_much)
         xlen -= i;
     }
 }
+
+static uint64_t prng_state = 0x9e3779b97f4a7c15ULL;
+
+void prng_seed(uint64_t seed)
+{
+    /* Scramble seed with splitmix64 so that small seeds work well too */
+    uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    /* State of xorshift must never be zero */
+    prng_state = z ? z : 0x9e3779b97f4a7c15ULL;
+}
+
+uint64_t prng_next(void)
+{
+    uint64_t x = prng_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    prng_state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
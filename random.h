@@ -6,6 +6,13 @@
 
 void randombytes(uint8_t *x, size_t xlen);
 
+/*
+ * Fast deterministic generator (xorshift64*) for reproducible test runs.
+ * Same seed gives same sequence.
+ */
+void prng_seed(uint64_t seed);
+uint64_t prng_next(void);
+
 static inline uint8_t randombit(void)
 {
     uint8_t ret = 0;
@@ -17,6 +17,11 @@ static FILE *errfile = NULL;
 static FILE *verbfile = NULL;
 static FILE *logfile = NULL;
 
+/* Stream copying reports while output is captured */
+static FILE *capfile = NULL;
+static char *capbuf = NULL;
+static size_t caplen = 0;
+
 int verblevel = 0;
 static void init_files(FILE *efile, FILE *vfile)
 {
@@ -73,6 +78,14 @@ void report_event(message_t msg, char *fmt, ...)
     fflush(errfile);
     va_end(ap);
 
+    if (capfile) {
+        va_start(ap, fmt);
+        fprintf(capfile, "%s: ", msg_name);
+        vfprintf(capfile, fmt, ap);
+        fprintf(capfile, "\n");
+        va_end(ap);
+    }
+
     if (logfile) {
         va_start(ap, fmt);
         fprintf(logfile, "Error: ");
@@ -103,6 +116,13 @@ void report(int level, char *fmt, ...)
         fflush(verbfile);
         va_end(ap);
 
+        if (capfile) {
+            va_start(ap, fmt);
+            vfprintf(capfile, fmt, ap);
+            fprintf(capfile, "\n");
+            va_end(ap);
+        }
+
         if (logfile) {
             va_start(ap, fmt);
             vfprintf(logfile, fmt, ap);
@@ -125,6 +145,12 @@ void report_noreturn(int level, char *fmt, ...)
         fflush(verbfile);
         va_end(ap);
 
+        if (capfile) {
+            va_start(ap, fmt);
+            vfprintf(capfile, fmt, ap);
+            va_end(ap);
+        }
+
         if (logfile) {
             va_start(ap, fmt);
             vfprintf(logfile, fmt, ap);
@@ -134,6 +160,24 @@ void report_noreturn(int level, char *fmt, ...)
     }
 }
 
+bool capture_begin()
+{
+    if (!capfile)
+        capfile = open_memstream(&capbuf, &caplen);
+    return capfile != NULL;
+}
+
+char *capture_end(size_t *lenp)
+{
+    *lenp = 0;
+    if (!capfile)
+        return NULL;
+    fclose(capfile);
+    capfile = NULL;
+    *lenp = caplen;
+    return capbuf;
+}
+
 /* Functions denoting failures */
 
 /* Need to be able to print without using malloc */
@@ -274,6 +318,12 @@ void free_string(char *s)
     free_block((void *) s, strlen(s) + 1);
 }
 
+void mem_usage(size_t *current, size_t *peak)
+{
+    *current = current_bytes;
+    *peak = peak_bytes;
+}
+
 /* Initialization of timers */
 void init_time(double *timep)
 {
@@ -31,6 +31,15 @@ void report(int verblevel, char *fmt, ...);
 /* Like report, but without return character */
 void report_noreturn(int verblevel, char *fmt, ...);
 
+/* Also copy everything reported into a buffer, until capture_end */
+bool capture_begin();
+
+/*
+ * Stop copying reports.  Return the buffer, which the caller frees with
+ * free, and set *lenp to its length.  Return NULL if nothing captured.
+ */
+char *capture_end(size_t *lenp);
+
 /* Attempt to call malloc.  Fail when returns NULL */
 void *malloc_or_fail(size_t bytes, char *fun_name);
 
@@ -49,6 +58,9 @@ void free_array(void *b, size_t cnt, size_t bytes);
 /* Free string saved by strsave_or_fail */
 void free_string(char *s);
 
+/* Current and peak bytes allocated through the functions above */
+void mem_usage(size_t *current, size_t *peak);
+
 /** Time measurement.  **/
 
 /* Time counted as fp number in seconds */
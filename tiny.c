@@ -1,27 +1,36 @@
-#include <arpa/inet.h> /* inet_ntoa */
+#include <arpa/inet.h> /* inet_ntop */
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> /* strncasecmp */
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "event.h"
+#include "report.h"
+#include "tiny.h"
+
 #define LISTENQ 1024 /* second argument to listen() */
 #define MAXLINE 1024 /* max length of a line */
-#define RIO_BUFSIZE 1024
-
-#ifndef DEFAULT_PORT
-#define DEFAULT_PORT 9999 /* use this port if none given as arg to main() */
-#endif
+#define REQ_BUFSIZE 8192   /* initial size of a connection buffer */
+#define REQ_MAXSIZE 1048576 /* max length of a request with its body */
+#define FILE_PREFIX "/file/"  /* paths of files served from the directory */
+#define FILE_CACHE 16        /* number of files kept open */
+#define STATS_PATH "/stats"   /* path of statistics in JSON */
 
 #define FORK_COUNT 2
 
@@ -29,21 +38,89 @@
 #define LOG_ACCESS
 #endif
 
+#define LOG_RING 4096     /* access log records buffered, power of 2 */
+#define LOG_NAME 40       /* bytes of request name kept in a record */
+#define LOG_BATCH 8192    /* bytes of log lines written at once */
+
+/* File kept open, so that requests for hot files need no open() */
 typedef struct {
-    int rio_fd;                /* descriptor for this buf */
-    int rio_cnt;               /* unread byte in this buf */
-    char *rio_bufptr;          /* next unread byte in this buf */
-    char rio_buf[RIO_BUFSIZE]; /* internal buffer */
-} rio_t;
+    char *path;
+    int fd;
+    struct stat st;
+    int refs; /* responses sending from it, plus one while cached */
+    unsigned long used;
+} file_ent;
 
-/* Simplifies calls to bind(), connect(), and accept() */
-typedef struct sockaddr SA;
+static file_ent *file_cache[FILE_CACHE];
+static unsigned long file_tick = 0;
 
+/*
+ * Part of the output of a connection, sent as is once it can be:
+ * either a block in memory or a range of an open file.
+ */
+typedef struct out_chunk {
+    struct out_chunk *next;
+    char *data; /* freed once sent */
+    file_ent *file;
+    off_t off; /* start of range in file */
+    size_t len;
+} out_chunk;
+
+/*
+ * A client connection.  Its socket is non-blocking and served from the
+ * event loop, so a slow client never stalls the console.  Requests are
+ * collected in buf until complete; several may be pipelined in it.
+ * Responses not yet taken by the client wait in the out list.
+ */
 typedef struct {
-    char function_name[512];
-    off_t offset; /* for support Range */
-    size_t end;
-} http_request;
+    int fd; /* -1 once closed */
+    struct sockaddr_in addr;
+    char *buf;
+    size_t start; /* offset of current request in buf */
+    size_t len;   /* bytes received in buf */
+    size_t cap;   /* size of buf */
+    size_t scan;  /* bytes of current request head already parsed */
+    size_t need;  /* length of request whose head is parsed, 0 if none */
+    bool got_line; /* request line parsed */
+    http_request req;
+    out_chunk *out;
+    out_chunk **out_tail;
+    size_t outpos;   /* bytes of first chunk already sent */
+    int refs;        /* commands queued for this connection */
+    int failed;      /* commands of current request that failed */
+    bool closing;    /* close once all responses are sent */
+    bool corked;     /* TCP_CORK set until the out list is sent */
+    bool watch_in;   /* event loop reports input */
+    bool watch_out;  /* event loop reports room for output */
+} web_conn;
+
+/*
+ * Commands received, waiting for the console to execute them.  The output
+ * of a request is captured from its first command until its last, then
+ * sent back.  A request with no command to run is queued as an empty
+ * command, so that its response keeps its place after earlier ones.
+ */
+typedef struct web_cmd {
+    struct web_cmd *next;
+    web_conn *conn;
+    int status; /* response status of an empty command */
+    bool last;  /* last command of request */
+    http_request req; /* request of file to send, named by text */
+    char text[];
+} web_cmd;
+
+static web_stats_t local_stats;
+web_stats_t *web_stats = &local_stats;
+
+static stats_helper_function stats_helper = NULL;
+
+int web_files = 0;
+
+static web_cmd *cmd_head = NULL;
+static web_cmd **cmd_tail = &cmd_head;
+
+/* Command returned by web_recv and still running */
+static web_cmd *cmd_running = NULL;
 
 typedef struct {
     const char *extension;
@@ -52,7 +129,11 @@ typedef struct {
 
 // https://developer.mozilla.org/en-US/docs/Web/HTTP/Basics_of_HTTP/MIME_types/Common_types
 
+/* Sorted by extension, in lower case, for binary search */
 mime_map meme_types[] = {
+    {".3g2", "video/3gpp2"},
+    {".3gp", "video/3gpp"},
+    {".7z", "application/x-7z-compressed"},
     {".aac", "audio/aac"},
     {".abw", "application/x-abiword"},
     {".arc", "application/x-freearc"},
@@ -70,8 +151,8 @@ mime_map meme_types[] = {
      "application/vnd.openxmlformats-officedocument.wordprocessingml.document"},
     {".eot", "application/vnd.ms-fontobject"},
     {".epub", "application/epub+zip"},
-    {".gz", "application/gzip"},
     {".gif", "image/gif"},
+    {".gz", "application/gzip"},
     {".htm", "text/html"},
     {".html", "text/html"},
     {".ico", "image/vnd.microsoft.icon"},
@@ -97,9 +178,9 @@ mime_map meme_types[] = {
     {".ogx", "application/ogg"},
     {".opus", "audio/opus"},
     {".otf", "font/otf"},
-    {".png", "image/png"},
     {".pdf", "application/pdf"},
     {".php", "application/x-httpd-php"},
+    {".png", "image/png"},
     {".ppt", "application/vnd.ms-powerpoint"},
     {".pptx",
      "application/"
@@ -129,102 +210,53 @@ mime_map meme_types[] = {
     {".xml", "text/xml"},
     {".xul", "application/vnd.mozilla.xul+xml"},
     {".zip", "application/zip"},
-    {".3gp", "video/3gpp"},
-    {".3g2", "video/3gpp2"},
-    {".7z", "application/x-7z-compressed"},
-    {NULL, NULL},
 };
 
 char *default_mime_type = "text/plain";
 
-void rio_readinitb(rio_t *rp, int fd)
-{
-    rp->rio_fd = fd;
-    rp->rio_cnt = 0;
-    rp->rio_bufptr = rp->rio_buf;
-}
-
 /*
- * rio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ * Compare extension ext of len bytes with a table entry, ignoring case.
+ * A shorter extension sorts before a longer one it is a prefix of.  The
+ * extension may hold a decoded null character, where strncasecmp stops.
  */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+static int compare_extension(const char *ext, size_t len, const char *entry)
 {
-    int cnt;
-    while (rp->rio_cnt <= 0) { /* refill if buf is empty */
-
-        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
-        if (rp->rio_cnt < 0) {
-            if (errno != EINTR) { /* interrupted by sig handler return */
-                return -1;
-            }
-        } else if (rp->rio_cnt == 0) { /* EOF */
-            return 0;
-        } else
-            rp->rio_bufptr = rp->rio_buf; /* reset buffer ptr */
-    }
-
-    /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
-    cnt = n;
-    if (rp->rio_cnt < n) {
-        cnt = rp->rio_cnt;
-    }
-    memcpy(usrbuf, rp->rio_bufptr, cnt);
-    rp->rio_bufptr += cnt;
-    rp->rio_cnt -= cnt;
-    return cnt;
+    int cmp = strncasecmp(ext, entry, len);
+    if (cmp)
+        return cmp;
+    if (strnlen(entry, len) < len)
+        return 1;
+    return entry[len] ? -1 : 0;
 }
 
-/*
- * rio_readlineb - robustly read a text line (buffered)
- */
-ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+static const char *get_mime_type(const char *name, size_t len)
 {
-    int n;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) {
-        int rc;
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n') {
-                break;
-            }
-        } else if (rc == 0) {
-            if (n == 1) {
-                return 0; /* EOF, no data read */
-            } else {
-                break; /* EOF, some data was read */
-            }
-        } else {
-            return -1; /* error */
+    const char *dot = NULL;
+    for (size_t i = len; i > 0; i--) {
+        if (name[i - 1] == '.') {
+            dot = name + i - 1;
+            break;
         }
     }
-    *bufp = 0;
-    return n;
-}
-
-static const char *get_mime_type(char *function_name)
-{
-    char *dot = strrchr(function_name, '.');
-    if (dot) {  // strrchar Locate last occurrence of character in string
-        mime_map *map = meme_types;
-        while (map->extension) {
-            if (strcmp(map->extension, dot) == 0) {
-                return map->mime_type;
-            }
-            map++;
+    if (dot) {
+        size_t ext_len = name + len - dot;
+        size_t lo = 0, hi = sizeof(meme_types) / sizeof(meme_types[0]);
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            int cmp =
+                compare_extension(dot, ext_len, meme_types[mid].extension);
+            if (cmp == 0)
+                return meme_types[mid].mime_type;
+            if (cmp < 0)
+                hi = mid;
+            else
+                lo = mid + 1;
         }
     }
     return default_mime_type;
 }
 
-int open_listenfd(int port)
+int open_listenfd(int port, bool shared)
 {
     int listenfd, optval = 1;
     struct sockaddr_in serveraddr;
@@ -240,13 +272,17 @@ int open_listenfd(int port)
         return -1;
     }
 
-    // 6 is TCP's protocol number
-    // enable this, much faster : 4000 req/s -> 17000 req/s
-    if (setsockopt(listenfd, 6, TCP_CORK, (const void *) &optval, sizeof(int)) <
-        0) {
+    /* Let worker processes each listen on the port, the kernel spreading
+     * connections among them */
+    if (shared && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                             (const void *) &optval, sizeof(int)) < 0) {
         return -1;
     }
 
+    /* TCP_CORK would be inherited by every connection, holding back each
+     * response on a kept-alive one for 200 ms.  Responses sending files
+     * set it themselves instead. */
+
     /* Listenfd will be an endpoint for all requests to port
        on any IP address for this host */
     memset(&serveraddr, 0, sizeof(serveraddr));
@@ -264,96 +300,952 @@ int open_listenfd(int port)
     return listenfd;
 }
 
-void url_decode(char *src, char *dest, int max)
+static int hex_value(char ch)
 {
-    char *p = src;
-    char code[3] = {0};
-    while (*p && --max) {
-        if (*p == '%') {
-            memcpy(code, ++p, 2);
-            *dest++ = (char) strtoul(code, NULL, 16);
-            p += 2;
-        } else {
-            *dest++ = *p++;
+    return isdigit((unsigned char) ch) ? ch - '0'
+                                       : tolower((unsigned char) ch) - 'a' + 10;
+}
+
+/*
+ * Take the command named by the path of uri: drop the leading '/' and
+ * any query, decode %XX escapes and turn later '/' into ' ', all in place.
+ */
+static void parse_uri(char *req, char *uri, size_t len, http_request *r)
+{
+    size_t plen = strlen(STATS_PATH);
+    r->stats = len >= plen && !memcmp(uri, STATS_PATH, plen) &&
+               (len == plen || uri[plen] == '?');
+    plen = strlen(FILE_PREFIX);
+    if (len > plen && !memcmp(uri, FILE_PREFIX, plen)) {
+        /* File path keeps its '/' */
+        r->file = true;
+        uri += plen;
+        len -= plen;
+    } else if (len && uri[0] == '/') {
+        if (len == 1 || uri[1] == '?') {
+            /* Root names the current directory */
+            uri[0] = '.';
+            r->function_name.off = uri - req;
+            r->function_name.len = 1;
+            return;
+        }
+        uri++;
+        len--;
+    }
+    char *dst = uri;
+    for (size_t i = 0; i < len && uri[i] != '?'; i++) {
+        char ch = uri[i];
+        if (ch == '%' && i + 2 < len && isxdigit((unsigned char) uri[i + 1]) &&
+            isxdigit((unsigned char) uri[i + 2])) {
+            ch = hex_value(uri[i + 1]) << 4 | hex_value(uri[i + 2]);
+            i += 2;
         }
+        if (ch == '/' && dst != uri && !r->file)
+            ch = ' ';
+        *dst++ = ch;
     }
-    *dest = '\0';
+    r->function_name.off = uri - req;
+    r->function_name.len = dst - uri;
+}
+
+/* Parse "METHOD URI VERSION" */
+static void parse_request_line(char *req, char *line, size_t n,
+                               http_request *r)
+{
+    char *end = line + n;
+    char *uri = memchr(line, ' ', n);
+    uri = uri ? uri + 1 : end;
+    char *version = memchr(uri, ' ', end - uri);
+    char *uri_end = version ? version : end;
+    version = version ? version + 1 : end;
+
+    r->post = uri - line == 5 && !memcmp(line, "POST", 4);
+    /* Connections persist by default from HTTP/1.1 on */
+    r->keep_alive = version < end && !(end - version == 8 &&
+                                       !memcmp(version, "HTTP/1.0", 8));
+    parse_uri(req, uri, uri_end - uri, r);
 }
 
-void parse_request(int fd, http_request *req)
+/* Match header line against name, which ends with ':', return its value */
+static char *header_value(char *line, size_t n, const char *name)
 {
-    rio_t rio;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
-    req->offset = 0;
-    req->end = 0; /* default */
+    size_t len = strlen(name);
+    if (n < len || strncasecmp(line, name, len))
+        return NULL;
+    line += len;
+    while (*line == ' ' || *line == '\t')
+        line++;
+    return line;
+}
 
-    rio_readinitb(&rio, fd);
-    rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%1023s %1023s", method, uri); /* version is not cared */
-    /* read all */
-    while (buf[0] != '\n' && buf[1] != '\n') { /* \n || \r\n */
-        rio_readlineb(&rio, buf, MAXLINE);
-        if (buf[0] == 'R' && buf[1] == 'a' && buf[2] == 'n') {
-            sscanf(buf, "Range: bytes=%lu-%zu", &req->offset, &req->end);
-            // Range: [start, end]
-            if (req->end != 0) {
-                req->end++;
+static void parse_header(char *line, size_t n, http_request *r)
+{
+    char *v;
+    if ((v = header_value(line, n, "Content-Length:"))) {
+        r->content_length = strtoul(v, NULL, 10);
+    } else if ((v = header_value(line, n, "Connection:"))) {
+        if (!strncasecmp(v, "close", 5))
+            r->keep_alive = false;
+        else if (!strncasecmp(v, "keep-alive", 10))
+            r->keep_alive = true;
+    } else if ((v = header_value(line, n, "Range:"))) {
+        // Range: bytes=start-end, [start, end]
+        if (!strncasecmp(v, "bytes=", 6)) {
+            r->range = true;
+            v += 6;
+            if (*v == '-') {
+                /* bytes=-n: last n bytes */
+                r->suffix = true;
+                r->offset = strtoul(v + 1, NULL, 10);
+            } else {
+                r->offset = strtoul(v, &v, 10);
+                if (*v == '-' && isdigit((unsigned char) v[1])) {
+                    r->has_end = true;
+                    r->end = strtoul(v + 1, NULL, 10) + 1;
+                }
             }
         }
     }
-    char *function_name = uri;
-    if (uri[0] == '/') {
-        function_name = uri + 1;
-        int length = strlen(function_name);
-        if (length == 0) {
-            function_name = ".";
-        } else {
-            int i = 0;
-            for (; i < length; ++i) {
-                if (function_name[i] == '?') {
-                    function_name[i] = '\0';
-                    break;
-                }
+}
+
+/*
+ * Parse the lines of the current request head that arrived since the
+ * last call, in place in the connection buffer and without copying them.
+ * Lines are found with memchr, which the C library vectorizes.
+ * Return true once the blank line ending the head is in.
+ */
+static bool parse_head(web_conn *c)
+{
+    char *req = c->buf + c->start;
+    size_t avail = c->len - c->start;
+
+    while (c->scan < avail) {
+        char *line = req + c->scan;
+        char *eol = memchr(line, '\n', avail - c->scan);
+        if (!eol)
+            return false;
+        size_t n = eol - line;
+        c->scan += n + 1;
+        if (n && line[n - 1] == '\r')
+            n--;
+        /* Strings parsed from the line stop at its end */
+        if (!c->got_line) {
+            if (n) {
+                parse_request_line(req, line, n, &c->req);
+                c->got_line = true;
             }
+        } else if (n) {
+            parse_header(line, n, &c->req);
+        } else {
+            return true;
         }
     }
-    url_decode(function_name, req->function_name, MAXLINE);
+    return false;
 }
 
 #ifdef LOG_ACCESS
-void log_access(int status, struct sockaddr_in *c_addr, http_request *req)
+/*
+ * Access log entry.  The server only copies what it knows into a record;
+ * turning it into text is left to the log writer, off the request path.
+ */
+typedef struct {
+    struct in_addr addr;
+    in_port_t port;
+    short status; /* 0 for an accepted connection */
+    int fd;
+    const char *type;
+    unsigned char len; /* bytes of name kept */
+    bool cut;          /* name was longer than LOG_NAME */
+    char name[LOG_NAME];
+} log_record;
+
+/*
+ * Records pass through a ring with a single producer, the server, and a
+ * single consumer, the writer thread, so neither side takes a lock.
+ * When the writer falls behind, new records are dropped and counted.
+ */
+static log_record log_ring[LOG_RING];
+static atomic_size_t log_head;    /* next record to fill */
+static atomic_size_t log_tail;    /* next record to write */
+static atomic_size_t log_dropped; /* records lost to a full ring */
+static atomic_bool log_stop;
+static pthread_t log_thread;
+static bool log_started = false;
+
+/*
+ * With nothing to write, the writer sleeps on log_wake after raising
+ * log_waiting, so the server only signals it when it is asleep.
+ */
+static atomic_bool log_waiting;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+
+static size_t format_record(char *buf, size_t size, const log_record *r)
+{
+    char addr[INET_ADDRSTRLEN];
+    int n;
+
+    if (!r->status) {
+        n = snprintf(buf, size, "accept request, fd is %d, pid is %d\n",
+                     r->fd, (int) getpid());
+    } else {
+        if (!inet_ntop(AF_INET, &r->addr, addr, sizeof(addr)))
+            strcpy(addr, "?");
+        n = snprintf(buf, size, "%s:%d %d - '%.*s%s' (%s)\n", addr,
+                     ntohs(r->port), r->status, (int) r->len, r->name,
+                     r->cut ? "..." : "", r->type);
+    }
+    return n < 0 ? 0 : (size_t) n < size ? (size_t) n : size - 1;
+}
+
+/* Write out logged records in batches, until asked to stop */
+static void *log_writer(void *arg)
 {
-    printf("%s:%d %d - '%s' (%s)\n", inet_ntoa(c_addr->sin_addr),
-           ntohs(c_addr->sin_port), status, req->function_name,
-           get_mime_type(req->function_name));
+    char buf[LOG_BATCH];
+    size_t dropped = 0;
+
+    while (1) {
+        /* Check first, so that records logged before stopping get out */
+        bool stop = atomic_load(&log_stop);
+        size_t tail = atomic_load_explicit(&log_tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&log_head, memory_order_acquire);
+        size_t len = 0;
+
+        for (; tail != head; tail++) {
+            if (len + MAXLINE > sizeof(buf)) {
+                fwrite(buf, 1, len, stdout);
+                len = 0;
+            }
+            len += format_record(buf + len, sizeof(buf) - len,
+                                 &log_ring[tail & (LOG_RING - 1)]);
+        }
+        atomic_store_explicit(&log_tail, tail, memory_order_release);
+
+        size_t lost = atomic_load_explicit(&log_dropped, memory_order_relaxed);
+        if (lost != dropped) {
+            len += snprintf(buf + len, sizeof(buf) - len,
+                            "(%zu access log records dropped)\n",
+                            lost - dropped);
+            dropped = lost;
+        }
+        if (len) {
+            fwrite(buf, 1, len, stdout);
+            fflush(stdout);
+        } else if (stop) {
+            break;
+        } else {
+            /* Look again after announcing the wait, not to miss a record */
+            pthread_mutex_lock(&log_lock);
+            atomic_store(&log_waiting, true);
+            if (atomic_load(&log_head) == tail && !atomic_load(&log_stop))
+                pthread_cond_wait(&log_wake, &log_lock);
+            atomic_store(&log_waiting, false);
+            pthread_mutex_unlock(&log_lock);
+        }
+    }
+    return NULL;
+}
+
+static void log_signal(void)
+{
+    pthread_mutex_lock(&log_lock);
+    pthread_cond_signal(&log_wake);
+    pthread_mutex_unlock(&log_lock);
+}
+
+/* Stop the writer once it has written everything logged */
+static void log_finish(void)
+{
+    atomic_store(&log_stop, true);
+    log_signal();
+    pthread_join(log_thread, NULL);
+}
+
+static bool log_start(void)
+{
+    sigset_t all, old;
+
+    /*
+     * The writer must not take signals meant for the console, such as
+     * the watchdog alarm, whose handler jumps back into the main thread.
+     */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    log_started = !pthread_create(&log_thread, NULL, log_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (log_started)
+        atexit(log_finish);
+    return log_started;
+}
+
+/* Claim the next free record, or return NULL if it has to be dropped */
+static log_record *log_claim(void)
+{
+    if (!log_started && !log_start())
+        return NULL;
+    size_t head = atomic_load_explicit(&log_head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&log_tail, memory_order_acquire);
+    if (head - tail == LOG_RING) {
+        atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+        return NULL;
+    }
+    return &log_ring[head & (LOG_RING - 1)];
+}
+
+/* Hand the record last claimed over to the writer, waking it if asleep */
+static void log_commit(void)
+{
+    size_t head = atomic_load_explicit(&log_head, memory_order_relaxed);
+    atomic_store(&log_head, head + 1);
+    if (atomic_load(&log_waiting))
+        log_signal();
+}
+
+static void log_accept(int fd)
+{
+    log_record *r = log_claim();
+    if (!r)
+        return;
+    r->status = 0;
+    r->fd = fd;
+    log_commit();
+}
+
+static void log_access(int status,
+                       struct sockaddr_in *c_addr,
+                       const char *name,
+                       size_t len)
+{
+    log_record *r = log_claim();
+    if (!r)
+        return;
+    r->addr = c_addr->sin_addr;
+    r->port = c_addr->sin_port;
+    r->status = status;
+    r->type = get_mime_type(name, len);
+    r->cut = len > LOG_NAME;
+    r->len = r->cut ? LOG_NAME : len;
+    memcpy(r->name, name, r->len);
+    log_commit();
 }
 #endif
 
-char *process(int fd, struct sockaddr_in *clientaddr)
+/* Queue a command of len bytes for the console */
+static web_cmd *queue_command(web_conn *c,
+                              const char *text,
+                              size_t len,
+                              int status,
+                              bool last)
+{
+    web_cmd *cmd = malloc(sizeof(web_cmd) + len + 1);
+    if (!cmd)
+        return NULL;
+    memcpy(cmd->text, text, len);
+    cmd->text[len] = '\0';
+    cmd->conn = c;
+    cmd->status = status;
+    cmd->last = last;
+    cmd->req.file = false;
+    cmd->next = NULL;
+    *cmd_tail = cmd;
+    cmd_tail = &cmd->next;
+    c->refs++;
+    return cmd;
+}
+
+/* Queue each non-empty line of a POST body as a command */
+static void queue_body(web_conn *c, const char *body, size_t len)
+{
+    const char *line = NULL;
+    size_t line_len = 0;
+
+    /* Hold back each line until the next shows whether it is the last */
+    while (len) {
+        const char *eol = memchr(body, '\n', len);
+        size_t n = eol ? (size_t) (eol - body) : len;
+        size_t skip = eol ? n + 1 : n;
+        if (n && body[n - 1] == '\r')
+            n--;
+        if (n) {
+            if (line)
+                queue_command(c, line, line_len, 200, false);
+            line = body;
+            line_len = n;
+        }
+        body += skip;
+        len -= skip;
+    }
+    if (line)
+        queue_command(c, line, line_len, 200, true);
+    else
+        queue_command(c, "", 0, 200, true);
+}
+
+/* Release a reference to an open file */
+static void put_file(file_ent *f)
+{
+    if (--f->refs == 0) {
+        close(f->fd);
+        free(f->path);
+        free(f);
+    }
+}
+
+/*
+ * Return open file at path, taking a reference to it, or NULL if it is
+ * not a regular file.  Files are kept open for later requests, and
+ * reopened when they have changed since.
+ */
+static file_ent *get_file(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+        return NULL;
+
+    int slot = 0;
+    for (int i = 0; i < FILE_CACHE; i++) {
+        file_ent *f = file_cache[i];
+        if (f && !strcmp(f->path, path)) {
+            if (f->st.st_ino == st.st_ino && f->st.st_dev == st.st_dev &&
+                f->st.st_size == st.st_size &&
+                f->st.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+                f->st.st_mtim.tv_nsec == st.st_mtim.tv_nsec) {
+                f->used = ++file_tick;
+                f->refs++;
+                return f;
+            }
+            slot = i;
+            break;
+        }
+        /* Otherwise replace a free or the least recently used entry */
+        if (!f || (file_cache[slot] && f->used < file_cache[slot]->used))
+            slot = i;
+    }
+
+    file_ent *f = malloc(sizeof(file_ent));
+    if (!f)
+        return NULL;
+    f->fd = open(path, O_RDONLY);
+    f->path = strdup(path);
+    if (f->fd < 0 || !f->path || fstat(f->fd, &f->st) < 0) {
+        if (f->fd >= 0)
+            close(f->fd);
+        free(f->path);
+        free(f);
+        return NULL;
+    }
+    if (file_cache[slot])
+        put_file(file_cache[slot]);
+    file_cache[slot] = f;
+    f->used = ++file_tick;
+    f->refs = 2;
+    return f;
+}
+
+static void free_chunk(out_chunk *chunk)
+{
+    if (chunk->file)
+        put_file(chunk->file);
+    free(chunk->data);
+    free(chunk);
+}
+
+/* Append a block to the output of a connection, which then owns it */
+static void conn_send(web_conn *c, char *data, size_t len)
+{
+    out_chunk *chunk = len ? malloc(sizeof(out_chunk)) : NULL;
+    if (!chunk) {
+        free(data);
+        return;
+    }
+    chunk->data = data;
+    chunk->file = NULL;
+    chunk->len = len;
+    chunk->next = NULL;
+    *c->out_tail = chunk;
+    c->out_tail = &chunk->next;
+}
+
+/* Append a range of a file to the output, taking over the reference */
+static void conn_send_file(web_conn *c, file_ent *f, off_t off, size_t len)
 {
+    out_chunk *chunk = len ? malloc(sizeof(out_chunk)) : NULL;
+    if (!chunk) {
+        put_file(f);
+        return;
+    }
+    chunk->data = NULL;
+    chunk->file = f;
+    chunk->off = off;
+    chunk->len = len;
+    chunk->next = NULL;
+    *c->out_tail = chunk;
+    c->out_tail = &chunk->next;
+}
+
+static const char *status_reason(int status)
+{
+    switch (status) {
+    case 200:
+        return "OK";
+    case 206:
+        return "Partial Content";
+    case 404:
+        return "Not Found";
+    case 416:
+        return "Range Not Satisfiable";
+    case 413:
+        return "Payload Too Large";
+    case 431:
+        return "Request Header Fields Too Large";
+    case 500:
+        return "Internal Server Error";
+    default:
+        return "Command Failed";
+    }
+}
+
+/* Queue the head of a response, with extra header lines */
+static bool respond_head(web_conn *c,
+                         int status,
+                         const char *type,
+                         size_t len,
+                         const char *extra)
+{
+    /* No request follows a closing one, so it is the last to respond */
+    bool close = c->closing && c->refs <= 1;
+    char *head = malloc(MAXLINE);
+    if (!head)
+        return false;
+    int n = snprintf(head, MAXLINE,
+                     "HTTP/1.1 %d %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %zu\r\n"
+                     "%s"
+                     "Connection: %s\r\n\r\n",
+                     status, status_reason(status), type, len, extra,
+                     close ? "close" : "keep-alive");
+    conn_send(c, head, n);
+    return true;
+}
+
+/* Queue a response with body, which the connection then owns */
+static void respond(web_conn *c, int status, char *body, size_t len)
+{
+    if (respond_head(c, status, "text/plain", len, ""))
+        conn_send(c, body, len);
+    else
+        free(body);
+}
+
+/* Queue a response sending the file at path, or part of it */
+static void respond_file(web_conn *c, const char *path, http_request *req)
+{
+    /* Only files below the served directory, and only if asked to */
+    bool inside = web_files && path[0] != '/';
+    for (const char *p = path; p && inside; p = strchr(p, '/')) {
+        if (*p == '/')
+            p++;
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || !p[2]))
+            inside = false;
+    }
+    file_ent *f = inside ? get_file(path) : NULL;
+    if (!f) {
+        respond(c, 404, NULL, 0);
+        return;
+    }
+
+    char extra[MAXLINE];
+    off_t size = f->st.st_size;
+    off_t start = 0, stop = size;
+    int status = 200;
+    if (req->range) {
+        if (req->suffix) {
+            /* An empty suffix is unsatisfiable, like any empty range */
+            start = req->offset && req->offset < size ? size - req->offset : 0;
+            if (!req->offset)
+                stop = 0;
+        } else {
+            start = req->offset;
+            if (req->has_end && (off_t) req->end < size)
+                stop = req->end;
+        }
+        if (start >= stop) {
+            put_file(f);
+            snprintf(extra, sizeof(extra), "Content-Range: bytes */%ld\r\n",
+                     (long) size);
+            respond_head(c, 416, "text/plain", 0, extra);
+            return;
+        }
+        status = 206;
+        snprintf(extra, sizeof(extra),
+                 "Accept-Ranges: bytes\r\nContent-Range: bytes %ld-%ld/%ld\r\n",
+                 (long) start, (long) stop - 1, (long) size);
+    } else {
+        snprintf(extra, sizeof(extra), "Accept-Ranges: bytes\r\n");
+    }
+
+    if (!respond_head(c, status, get_mime_type(path, strlen(path)),
+                      stop - start, extra)) {
+        put_file(f);
+        return;
+    }
+    /* Hold back the head until file data can go in the same segment */
+    if (!c->corked) {
+        int on = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+        c->corked = true;
+    }
+    conn_send_file(c, f, start, stop - start);
+}
+
+/* Queue a response with web counters, and whatever the helper adds */
+static void respond_stats(web_conn *c)
+{
+    char *body = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&body, &len);
+    if (!out) {
+        respond(c, 500, NULL, 0);
+        return;
+    }
+    fprintf(out,
+            "{\"web\":{\"connections\":%zu,\"requests\":%zu,"
+            "\"commands\":%zu,\"failed\":%zu,\"bytes_sent\":%zu}",
+            web_stats->connections, web_stats->requests, web_stats->commands,
+            web_stats->failed, web_stats->bytes_sent);
+    if (stats_helper)
+        stats_helper(out);
+    fprintf(out, "}\n");
+    fclose(out);
+    if (respond_head(c, 200, "application/json", len, ""))
+        conn_send(c, body, len);
+    else
+        free(body);
+}
+
+/*
+ * Serve the first request in c->buf, if it has arrived completely.
+ * Return false if it has not.
+ */
+static bool serve_request(web_conn *c)
+{
+    http_request *req = &c->req;
+
+    if (!c->need) {
+        if (!parse_head(c)) {
+            if (c->start == 0 && c->len == REQ_MAXSIZE) {
+                c->closing = true;
+                queue_command(c, "", 0, 431, true);
+            }
+            return false;
+        }
+        size_t head_len = c->scan;
+        if (!req->post)
+            req->content_length = 0;
+        if (req->content_length > REQ_MAXSIZE - head_len) {
+            c->closing = true;
+            queue_command(c, "", 0, 413, true);
+            return false;
+        }
+        c->need = head_len + req->content_length;
+    }
+    if (c->len - c->start < c->need)
+        return false;
+
+    int status = 200;
+    char *base = c->buf + c->start;
+    web_stats->requests++;
+    char *name = base + req->function_name.off;
+    if (!req->keep_alive)
+        c->closing = true;
+    if (req->post) {
+        queue_body(c, base + c->need - req->content_length,
+                   req->content_length);
+    } else if (req->stats && !c->refs) {
+        respond_stats(c);
+    } else if (req->file && !c->refs) {
+        /* Nothing to wait for, send it right away */
+        char path[MAXLINE];
+        size_t len = req->function_name.len;
+        if (len < sizeof(path)) {
+            memcpy(path, name, len);
+            path[len] = '\0';
+            respond_file(c, path, req);
+        } else {
+            respond(c, 404, NULL, 0);
+        }
+    } else {
+        web_cmd *cmd =
+            queue_command(c, name, req->function_name.len, status, true);
+        if (cmd)
+            cmd->req = *req;
+    }
 #ifdef LOG_ACCESS
-    printf("accept request, fd is %d, pid is %d\n", fd, getpid());
+    log_access(status, &c->addr, name, req->function_name.len);
 #endif
-    http_request req;
-    parse_request(fd, &req);
-    int status = 200;
-    // handle_request(fd, req.function_name);
-
-    char *p = req.function_name;
-    /* Change '/' to ' ' */
-    while (*p) {
-        ++p;
-        if (*p == '/') {
-            *p = ' ';
+
+    /* Pipelined requests that follow stay in place */
+    c->start += c->need;
+    if (c->start == c->len)
+        c->start = c->len = 0;
+    c->need = c->scan = 0;
+    c->got_line = false;
+    memset(req, 0, sizeof(*req));
+    return true;
+}
+
+/*
+ * Close the socket of a connection and drop its unsent output.  The
+ * connection itself is freed once no queued command refers to it.
+ */
+static void close_conn(web_conn *c)
+{
+    if (c->fd >= 0) {
+        event_del(c->fd);
+        close(c->fd);
+        c->fd = -1;
+        free(c->buf);
+        c->buf = NULL;
+        while (c->out) {
+            out_chunk *chunk = c->out;
+            c->out = chunk->next;
+            free_chunk(chunk);
+        }
+    }
+    if (!c->refs)
+        free(c);
+}
+
+/* Tell the event loop what the connection waits for */
+static void watch_conn(web_conn *c, bool output)
+{
+    bool input = !c->closing;
+    if (input != c->watch_in || output != c->watch_out) {
+        event_set(c->fd, input, output);
+        c->watch_in = input;
+        c->watch_out = output;
+    }
+}
+
+/*
+ * Write as much pending output as the client takes.  Response heads and
+ * captured bodies are gathered into one writev call, and files are sent
+ * with sendfile, all without copying them.  Then close the connection if
+ * it is done.
+ */
+static void flush_conn(web_conn *c)
+{
+    while (c->out) {
+        ssize_t n;
+        if (c->out->file) {
+            off_t off = c->out->off + c->outpos;
+            n = sendfile(c->fd, c->out->file->fd, &off,
+                         c->out->len - c->outpos);
+            if (n == 0) {
+                /* File shrank since the response head was sent */
+                close_conn(c);
+                return;
+            }
+        } else {
+            struct iovec iov[16];
+            int cnt = 0;
+            size_t pos = c->outpos;
+            for (out_chunk *chunk = c->out; chunk && !chunk->file && cnt < 16;
+                 chunk = chunk->next) {
+                iov[cnt].iov_base = chunk->data + pos;
+                iov[cnt].iov_len = chunk->len - pos;
+                cnt++;
+                pos = 0;
+            }
+            n = writev(c->fd, iov, cnt);
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN) {
+            watch_conn(c, true);
+            return;
+        }
+        if (n < 0) {
+            close_conn(c);
+            return;
+        }
+        c->outpos += n;
+        web_stats->bytes_sent += n;
+        while (c->out && c->outpos >= c->out->len) {
+            out_chunk *chunk = c->out;
+            c->outpos -= chunk->len;
+            c->out = chunk->next;
+            free_chunk(chunk);
+        }
+    }
+    c->out_tail = &c->out;
+    if (c->corked) {
+        /* Push out what the cork holds back */
+        int off = 0;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+        c->corked = false;
+    }
+    if (c->closing && !c->refs)
+        close_conn(c);
+    else
+        watch_conn(c, false);
+}
+
+/* Read what has arrived on a connection and serve complete requests */
+static void conn_ready(int fd, void *data)
+{
+    web_conn *c = data;
+
+    if (!c->watch_in && !c->watch_out) {
+        /* Only a hangup or error can be reported */
+        close_conn(c);
+        return;
+    }
+    while (!c->closing) {
+        if (c->len == c->cap && c->start) {
+            /* Move the request being received to the front */
+            c->len -= c->start;
+            memmove(c->buf, c->buf + c->start, c->len);
+            c->start = 0;
+        }
+        if (c->len == c->cap) {
+            if (c->cap == REQ_MAXSIZE)
+                break; /* Let serve_request complain */
+            size_t cap = 2 * c->cap;
+            char *buf = realloc(c->buf, cap);
+            if (!buf) {
+                close_conn(c);
+                return;
+            }
+            c->buf = buf;
+            c->cap = cap;
+        }
+        ssize_t n = read(fd, c->buf + c->len, c->cap - c->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            break; /* Wait for more */
+        if (n <= 0) {
+            /* Answer requests already in, then close */
+            while (!c->closing && serve_request(c))
+                ;
+            c->closing = true;
+            break;
         }
+        c->len += n;
     }
+
+    while (!c->closing && serve_request(c))
+        ;
+    flush_conn(c);
+}
+
+/* Accept all pending connections and watch them for requests */
+static void accept_ready(int fd, void *data)
+{
+    while (1) {
+        web_conn *c = calloc(1, sizeof(web_conn));
+        if (!c)
+            return;
+        socklen_t clientlen = sizeof(c->addr);
+        c->fd = accept(fd, (SA *) &c->addr, &clientlen);
+        if (c->fd < 0) {
+            free(c);
+            return;
+        }
+        fcntl(c->fd, F_SETFL, O_NONBLOCK);
+        web_stats->connections++;
 #ifdef LOG_ACCESS
-    log_access(status, clientaddr, &req);
+        log_accept(c->fd);
 #endif
-    char *ret = malloc(strlen(req.function_name) + 1);
-    strncpy(ret, req.function_name, strlen(req.function_name) + 1);
+        c->buf = malloc(REQ_BUFSIZE);
+        c->cap = REQ_BUFSIZE;
+        c->out_tail = &c->out;
+        c->watch_in = true;
+        if (!c->buf || !event_add(c->fd, conn_ready, c)) {
+            close(c->fd);
+            free(c->buf);
+            free(c);
+        }
+    }
+}
 
-    return ret;
+/* Account for a command having run, and respond after the last one */
+static void finish_command(web_cmd *cmd, bool ok)
+{
+    web_conn *c = cmd->conn;
+
+    if (cmd->text[0] && !cmd->req.file && !cmd->req.stats) {
+        web_stats->commands++;
+        if (!ok)
+            web_stats->failed++;
+    }
+    if (!ok)
+        c->failed++;
+    if (cmd->req.file) {
+        if (c->fd >= 0)
+            respond_file(c, cmd->text, &cmd->req);
+    } else if (cmd->req.stats) {
+        if (c->fd >= 0)
+            respond_stats(c);
+    } else if (cmd->last) {
+        size_t len;
+        char *body = capture_end(&len);
+        int status = cmd->status;
+        if (status == 200 && c->failed)
+            status = 400;
+        c->failed = 0;
+        if (c->fd >= 0)
+            respond(c, status, body, len);
+        else
+            free(body);
+    }
+    c->refs--;
+    free(cmd);
+    if (c->fd >= 0)
+        flush_conn(c);
+    else if (!c->refs)
+        free(c);
+}
+
+void web_done(bool ok)
+{
+    if (cmd_running) {
+        web_cmd *cmd = cmd_running;
+        cmd_running = NULL;
+        finish_command(cmd, ok);
+    }
+}
+
+void set_stats_helper(stats_helper_function sf)
+{
+    stats_helper = sf;
+}
+
+char *web_recv(void)
+{
+    /* Caller is done with the previous command if it asks for another */
+    web_done(true);
+    while (cmd_head) {
+        web_cmd *cmd = cmd_head;
+        cmd_head = cmd->next;
+        if (!cmd_head)
+            cmd_tail = &cmd_head;
+        if (!cmd->text[0] || cmd->req.file || cmd->req.stats) {
+            finish_command(cmd, true);
+            continue;
+        }
+        char *ret = strdup(cmd->text);
+        if (!ret) {
+            finish_command(cmd, false);
+            continue;
+        }
+        capture_begin();
+        cmd_running = cmd;
+        return ret;
+    }
+    return NULL;
 }
 
 void print_help()
@@ -399,7 +1291,7 @@ int get_listenfd(int argc, char **argv)
     }
     printf("serve directory '%s'\n", path);
 
-    listenfd = open_listenfd(default_port);
+    listenfd = web_listen(default_port, false);
     if (listenfd > 0) {
         printf("listen on port %d, fd is %d\n", default_port, listenfd);
     } else {
@@ -412,3 +1304,18 @@ int get_listenfd(int argc, char **argv)
 
     return listenfd;
 }
+
+int web_listen(int port, bool shared)
+{
+    int listenfd = open_listenfd(port, shared);
+    if (listenfd < 0)
+        return -1;
+
+    /* Connections are accepted and read from the event loop */
+    fcntl(listenfd, F_SETFL, O_NONBLOCK);
+    if (!event_add(listenfd, accept_ready, NULL)) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
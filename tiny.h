@@ -1,13 +1,14 @@
 #ifndef __TINY_H__
 #define __TINY_H__
 
-#include <arpa/inet.h> /* inet_ntoa */
+#include <arpa/inet.h> /* inet_ntop */
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,17 +21,76 @@
 
 typedef struct sockaddr SA;
 
+#ifndef DEFAULT_PORT
+#define DEFAULT_PORT 9999 /* use this port if none given as arg to main() */
+#endif
+
+/* Part of a request, as offset from its start in the connection buffer */
+typedef struct {
+    size_t off;
+    size_t len;
+} slice;
+
 typedef struct {
-    char function_name[512];
-    off_t offset; /* for support Range */
-    size_t end;
+    slice function_name; /* decoded path, with '/' turned into ' ' */
+    off_t offset;        /* first byte of Range, or length of suffix */
+    size_t end;          /* byte after Range, if has_end */
+    bool range;            /* Range header given */
+    bool suffix;           /* Range of last offset bytes */
+    bool has_end;          /* Range gives its last byte */
+    bool file;             /* file to send rather than command */
+    bool stats;            /* statistics to send rather than command */
+    bool post;             /* POST, with commands in the body */
+    size_t content_length; /* body length */
+    bool keep_alive;       /* connection stays open after response */
 } http_request;
 
 extern int listenfd;
 
+/* Nonzero to serve files of the current directory under /file/ */
+extern int web_files;
+
 int get_listenfd(int argc, char **argv);
 
-// get the function_name
-char *process(int fd, struct sockaddr_in *clientaddr);
+/*
+ * Listen on port and serve requests from the event loop.  If shared,
+ * other processes may listen on the same port too.  Return listening
+ * descriptor, or -1 on error.
+ */
+int web_listen(int port, bool shared);
+
+/* Counters of web activity */
+typedef struct {
+    size_t connections;
+    size_t requests;
+    size_t commands;
+    size_t failed; /* commands that failed */
+    size_t bytes_sent;
+} web_stats_t;
+
+/* Where web activity is counted.  Workers point it to shared memory */
+extern web_stats_t *web_stats;
+
+/*
+ * Optionally supply function adding members to the JSON object served
+ * at STATS_PATH, after member "web" with the counters above.
+ * It writes each member preceded by a comma.
+ */
+typedef void (*stats_helper_function)(FILE *out);
+void set_stats_helper(stats_helper_function sf);
+
+/*
+ * Return the next command received over HTTP, or NULL if none is waiting.
+ * Requests are read without blocking from the event loop, which must be
+ * polled for commands to arrive.  Output reported from then on is
+ * captured as response to the request.  Caller frees the command.
+ */
+char *web_recv(void);
+
+/*
+ * Report that the command last returned by web_recv has run, successfully
+ * or not.  What it reported is sent back once its whole request has run.
+ */
+void web_done(bool ok);
 
 #endif
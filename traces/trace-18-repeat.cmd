@@ -0,0 +1,38 @@
+# Test of repeat blocks, variables and their substitution
+option fail 0
+option malloc 0
+new
+set n 3
+repeat $n i {
+ih $i
+}
+rh 2
+rh 1
+rh 0
+set x 10
+repeat 4 inc x
+it $x
+rh 14
+repeat 2 {
+inc x -2
+repeat 2 j {
+it $j
+}
+it $x
+}
+rh 0
+rh 1
+rh 12
+rh 0
+rh 1
+rh 10
+size 0
+# A variable set inside a block can be used after it in the block
+repeat 2 k {
+set y $k
+inc y 100
+ih $y
+}
+rh 101
+rh 100
+free